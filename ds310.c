@@ -19,187 +19,4562 @@
 #include <linux/init.h>
 #include <linux/cdev.h>
 #include <linux/i2c.h>
+#include <linux/delay.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/fixp-arith.h>
+#include <linux/hwmon.h>
+#include <linux/interrupt.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
+#include <uapi/linux/sched/types.h>
+
+#include "ds310.h"
+#include "ds310_altitude.h"
+
+/**
+ * Optional features, set to 0 or 1 by the Makefile. They are constants,
+ * so the compiler drops the code of disabled features and the remaining
+ * paths do not test them at run time.
+ */
+#ifndef DS310_FEATURE_STATS
+#define DS310_FEATURE_STATS 1
+#endif
+#ifndef DS310_FEATURE_REGISTER_PROTOCOL
+#define DS310_FEATURE_REGISTER_PROTOCOL 1
+#endif
+#ifndef DS310_FEATURE_COMPRESSION
+#define DS310_FEATURE_COMPRESSION 1
+#endif
+#ifndef DS310_FEATURE_TRACE
+#define DS310_FEATURE_TRACE 1
+#endif
+
+#if DS310_FEATURE_TRACE
+#define CREATE_TRACE_POINTS
+#endif
+#include "ds310_trace.h"
 
 #define VERSION "1.0"
 #define DRIVER_COMPATIBILITY "infineon,ds310_sensor"
 #define DRIVER_NAME "ds310_sensor"
 #define DRIVER_CLASS "ds310_sensor_class"
+#define DS310_AGGREGATE_NAME "ds310_all"
 #define DS310_SENSOR_ADDRESS 0x77
+#define DS310_SENSOR_ADDRESS_ALTERNATIVE 0x76
+
+/**
+ * ds310 sensor registers
+ */
+#define DS310_PSR_B2 0x00
+#define DS310_TMP_B2 0x03
+#define DS310_PRS_CFG 0x06
+#define DS310_TMP_CFG 0x07
+#define DS310_MEAS_CFG 0x08
+#define DS310_CFG_REG 0x09
+#define DS310_INT_STS 0x0A
+#define DS310_RESET 0x0C
+#define DS310_PRODUCT_ID 0x0D
+#define DS310_COEF 0x10
+#define DS310_RESULT_LENGTH 6
+#define DS310_COEF_LENGTH 18
+#define DS310_BLOCK_LENGTH 32
+#define DS310_OVERSAMPLING_MASK 0x07
+#define DS310_COEF_RDY 0x80
+#define DS310_PRS_RDY 0x10
+#define DS310_TMP_RDY 0x20
+#define DS310_SENSOR_RDY 0x40
+#define DS310_INT_PRS 0x10
+#define DS310_INT_STS_PRS 0x01
+#define DS310_FIFO_EN 0x02
+#define DS310_FIFO_FLUSH 0x80
+#define DS310_FIFO_LENGTH 32
+#define DS310_FIFO_EMPTY 0x800000
+#define DS310_FIFO_PRESSURE 0x01
+#define DS310_MEAS_CTRL_MASK 0x07
+#define DS310_MEAS_CTRL_PRS 0x01
+#define DS310_MEAS_CTRL_TMP 0x02
+#define DS310_MEAS_CTRL_BACKGROUND 0x05
+#define DS310_SOFT_RESET 0x09
+#define DS310_PRODUCT_ID_VALUE 0x10
+
+/**
+ * Sample stream
+ */
+#define DS310_RING_SIZE_MIN 64
+#define DS310_RING_SIZE_MAX (1 << 24)
+#define DS310_FETCH_BATCH 16
+#define DS310_READ_BATCH 256
+#define DS310_STATS_WINDOW 1024
+#define DS310_CACHE_MAX_AGE_MS 1000
+#define DS310_LATEST_SCAN 8
+#define DS310_FIFO_BATCH 8
+
+/**
+ * Recovery
+ */
+#define DS310_RECOVERY_FAILURES 8
+#define DS310_RESET_DELAY_MS 40
+#define DS310_RESET_ATTEMPTS 10
+#define DS310_WATCHDOG_INTERVAL HZ
+
+/**
+ * Device files and virtual sensors
+ */
+#define DS310_MAX_SENSORS 16
+#define DS310_VIRTUAL_NAME "ds310_virtual"
+#define DS310_VIRTUAL_RATE_MAX 100000
+#define DS310_VIRTUAL_BATCH_US 1000
+#define DS310_VIRTUAL_PRESSURE_RAW (-223938)
+#define DS310_VIRTUAL_TEMPERATURE_RAW 154700
+#define DS310_REPLAY_MAX_SAMPLES (1 << 20)
+
+/**
+ * Synchronized groups
+ */
+#define DS310_MAX_GROUPS 4
+#define DS310_GROUP_RING_SIZE 256
+#define DS310_GROUP_RATE_MAX 128
+#define DS310_GROUP_READY_US 500
+#define DS310_GROUP_READY_ATTEMPTS 500
+
+/**
+ * Calibration coefficients of the ds310 sensor
+ */
+struct ds310_sensor_calibration
+{
+    s32 c0;
+    s32 c1;
+    s32 c00;
+    s32 c10;
+    s32 c01;
+    s32 c11;
+    s32 c20;
+    s32 c21;
+    s32 c30;
+};
+
+/**
+ * Compensation scale factors indexed by the oversampling rate field
+ */
+static const s32 ds310_sensor_scale_factors[] =
+{
+    524288, 1572864, 3670016, 7864320, 253952, 516096, 1040384, 2088960,
+};
+
+/**
+ * Coefficient registers of virtual sensors, a typical ds310 calibration
+ */
+static const uint8_t ds310_sensor_virtual_coefficients[DS310_COEF_LENGTH] =
+{
+    0x0C, 0xCE, 0xFB, 0x13, 0xA5, 0x5F, 0x2A, 0x0F, 0xF7,
+    0x43, 0x04, 0xE6, 0xD8, 0xCD, 0x00, 0x8E, 0xFA, 0xCB,
+};
+
+/**
+ * Variables for Character Device files
+ */
+static dev_t ds310_sensor_device_number;
+static struct class *ds310_sensor_class;
+static DEFINE_IDA(ds310_sensor_minors);
+static DEFINE_IDA(ds310_sensor_indexes);
+
+static unsigned int poll_interval_ms = 10;
+module_param(poll_interval_ms, uint, 0444);
+MODULE_PARM_DESC(poll_interval_ms, "Interval of polling the result registers while streaming (default 10)");
+
+static unsigned int ring_size = 256;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Samples buffered per sensor, a power of two up to 16777216 (default 256)");
+
+static unsigned int irq_rate_max = 64;
+module_param(irq_rate_max, uint, 0644);
+MODULE_PARM_DESC(irq_rate_max, "Sample rate in Hz above which interrupts are replaced by batched FIFO reads, 0 to always interrupt (default 64)");
+
+static int acquisition_cpu = -1;
+module_param(acquisition_cpu, int, 0444);
+MODULE_PARM_DESC(acquisition_cpu, "CPU of the acquisition threads, -1 for any (default -1)");
+
+static int acquisition_priority = -1;
+module_param(acquisition_priority, int, 0444);
+MODULE_PARM_DESC(acquisition_priority, "SCHED_FIFO priority of the acquisition threads, 0 for SCHED_NORMAL, -1 to keep the kernel default (default -1)");
+
+static unsigned int netlink_interval_ms = 10;
+module_param(netlink_interval_ms, uint, 0444);
+MODULE_PARM_DESC(netlink_interval_ms, "Interval of publishing sample batches on the generic netlink family (default 10)");
+
+static unsigned int virtual_sensors = 0;
+module_param(virtual_sensors, uint, 0444);
+MODULE_PARM_DESC(virtual_sensors, "Number of virtual sensors without hardware (default 0)");
+
+static unsigned int virtual_rate_hz = 1000;
+module_param(virtual_rate_hz, uint, 0444);
+MODULE_PARM_DESC(virtual_rate_hz, "Sample rate of virtual sensors, up to 100000 (default 1000)");
+
+/**
+ * Samples shared by all streaming readers of a sensor
+ *
+ * The ring is one vmalloc area that user space can map, a header page
+ * followed by the samples, see struct ds310_ring_header. Producers are
+ * serialized by the sensor lock, readers never take it, every reader
+ * keeps its own tail and detects overwritten samples itself. head counts
+ * all samples for the readers in the kernel, the header publishes its
+ * low 32 bits, a native word on every architecture.
+ */
+struct ds310_sensor_stream
+{
+    struct ds310_ring_header *ring;
+    struct ds310_sample *samples;
+    u32 size;
+    atomic64_t head;
+    atomic64_t overruns;
+    atomic64_t errors;
+    wait_queue_head_t wait;
+    wait_queue_head_t acquisition_wait;
+    atomic_t readers;
+    struct task_struct *thread;
+};
+
+/**
+ * Polled sensors on one I2C adapter
+ *
+ * One thread polls every streaming sensor of the adapter back to back in
+ * a single pass, instead of one thread per sensor contending for the bus
+ * at independent times.
+ */
+struct ds310_sensor_bus
+{
+    struct list_head node;
+    struct i2c_adapter *adapter;
+
+    /* Serializes the sensor list against the pass */
+    struct mutex lock;
+    struct list_head sensors;
+
+    /* Sensors with at least one streaming reader */
+    atomic_t streaming;
+    wait_queue_head_t wait;
+    struct task_struct *thread;
+};
+
+/**
+ * State of a hardware or virtual ds310 sensor
+ */
+struct ds310_sensor
+{
+    struct i2c_client *client;
+    int minor;
+    int index;
+    struct cdev *character_device;
+    struct device *device;
+    struct device *hwmon;
+
+    /* Open files keep a removed sensor, gone once its acquisition stops */
+    struct kref refcount;
+    bool gone;
+
+    /* Data ready interrupt, 0 when the sensor is polled */
+    int irq;
+    u64 irq_timestamp;
+
+    /* Clock of the sample timestamps, changed only while nobody streams */
+    clockid_t timestamp_clock;
+
+    /* Interrupt sensors drain the FIFO from the acquisition thread at high rates */
+    bool batched;
+    u64 sample_period;
+    u64 rate_timestamp;
+    s32 fifo_temperature_raw;
+    bool fifo_temperature_fresh;
+    struct ds310_sample *fifo_samples;
+
+    /* Placement of the acquisition thread or interrupt thread */
+    int acquisition_cpu;
+    int acquisition_priority;
+    atomic_t priority_pending;
+
+    /* Serializes bus transfers, the register model and the configuration */
+    struct mutex lock;
+
+    /* Compensation */
+    struct ds310_sensor_calibration calibration;
+    uint8_t prs_cfg;
+    uint8_t tmp_cfg;
+    u32 sea_level_pressure;
+
+    struct ds310_sensor_stream stream;
+
+    /* DS310_SAMPLE_* flags for the next sample, set outside the acquisition */
+    atomic_t sample_flags;
+
+    /* Shared polling of a hardware sensor without interrupt */
+    struct ds310_sensor_bus *bus;
+    struct list_head bus_node;
+
+    /* Synchronized group and the measurement mode restored on leaving it */
+    struct ds310_sensor_sync_group *sync_group;
+    uint8_t meas_cfg;
+
+    /* Written registers, restored after a reset by the recovery work */
+    uint8_t shadow[256];
+    DECLARE_BITMAP(shadow_written, 256);
+    atomic_t failures;
+    atomic_t recoveries;
+    u64 watchdog_head;
+    struct delayed_work recovery;
+
+    /* Register model and sample source of a virtual sensor */
+    uint8_t registers[DS310_REGISTER_COUNT];
+    struct ds310_sample *replay;
+    u32 replay_count;
+    u32 replay_index;
+    u32 random_state;
+};
+
+static struct ds310_sensor *ds310_sensor_virtual[DS310_MAX_SENSORS];
+
+static LIST_HEAD(ds310_sensor_buses);
+static DEFINE_MUTEX(ds310_sensor_buses_lock);
+
+/**
+ * Sensors triggered together
+ *
+ * On every trigger, from the hrtimer at trigger_rate_hz or from a write
+ * to the group device file, a thread starts the conversions of all
+ * members back to back and publishes one combined record. The records
+ * use the same lockless ring protocol as the samples of a sensor.
+ */
+struct ds310_sensor_sync_group
+{
+    int index;
+    int minor;
+    struct cdev character_device;
+    struct device *device;
+
+    /* Serializes the members and the rate against a capture */
+    struct mutex lock;
+    struct ds310_sensor *members[DS310_GROUP_MAX_MEMBERS];
+    u32 count;
+    u32 rate_hz;
+    ktime_t period;
+
+    struct ds310_group_record *records;
+    atomic64_t head;
+    wait_queue_head_t wait;
+    atomic_t readers;
+
+    atomic_t triggers;
+    wait_queue_head_t trigger_wait;
+    struct hrtimer timer;
+    struct task_struct *thread;
+};
+
+/**
+ * State of an opened group device file
+ */
+struct ds310_sensor_sync_reader
+{
+    struct ds310_sensor_sync_group *group;
+    struct mutex lock;
+    u64 tail;
+};
+
+/* Groups live until the module is unloaded, open files keep them valid */
+static struct ds310_sensor_sync_group *ds310_sensor_sync_groups[DS310_MAX_GROUPS];
+static DEFINE_MUTEX(ds310_sensor_sync_groups_lock);
+
+/**
+ * State of an opened ds310_all device file
+ *
+ * Every sensor is streamed through its own record reader, samples are
+ * staged in the batch of that reader and merged by timestamp.
+ */
+struct ds310_sensor_aggregate_reader
+{
+    struct list_head node;
+
+    /* Serializes reads of the file, taken before ds310_sensor_table_lock */
+    struct mutex lock;
+    struct ds310_sensor_reader *readers[DS310_MAX_SENSORS];
+    u32 staged[DS310_MAX_SENSORS];
+    u32 position[DS310_MAX_SENSORS];
+    struct ds310_tagged_sample batch[DS310_READ_BATCH];
+};
+
+/* Sensors by minor number and the open ds310_all files streaming them */
+static struct ds310_sensor *ds310_sensor_table[DS310_MAX_SENSORS];
+static LIST_HEAD(ds310_sensor_aggregates);
+static DEFINE_MUTEX(ds310_sensor_table_lock);
+
+static struct cdev ds310_sensor_aggregate_device;
+static int ds310_sensor_aggregate_minor;
+static atomic_t ds310_sensor_aggregate_readers = ATOMIC_INIT(0);
+static atomic_long_t ds310_sensor_aggregate_generation = ATOMIC_LONG_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ds310_sensor_aggregate_wait);
+
+/**
+ * State of an opened device file
+ */
+struct ds310_sensor_reader
+{
+    struct ds310_sensor *sensor;
+    struct mutex lock;
+    uint8_t register_value;
+    u32 format;
+    u64 tail;
+    u64 dropped;
+    bool overrun;
+
+    /* Compressed stream encoder */
+    struct ds310_sample last;
+    s64 last_delta;
+    u32 frames_since_key;
+    bool key_pending;
+    uint8_t pending[DS310_FETCH_BATCH * DS310_FRAME_MAX_LENGTH];
+    size_t pending_length;
+    size_t pending_offset;
+
+    /* Transfer buffer, allocated with the reader so reads never allocate */
+    struct ds310_sample batch[DS310_READ_BATCH];
+};
+
+static struct of_device_id ds310_sensor_of_match[] = {
+    { .compatible = DRIVER_COMPATIBILITY, },
+    { },
+};
+MODULE_DEVICE_TABLE(of, ds310_sensor_of_match);
+
+static struct i2c_device_id ds310_sensor_id[] = {
+    { DRIVER_NAME, 0 },
+    { },
+};
+MODULE_DEVICE_TABLE(i2c, ds310_sensor_id);
+
+/**
+ * @brief Multiply two Q30 fixed-point values
+ */
+static s64 ds310_sensor_mul_q30(s64 a, s64 b)
+{
+    u64 product = mul_u64_u64_shr(a < 0 ? -a : a, b < 0 ? -b : b, 30);
+
+    return ((a < 0) != (b < 0)) ? -(s64)product : (s64)product;
+}
+
+/**
+ * @brief Read a register of the ds310 sensor or of the register model
+ *        of a virtual sensor
+ */
+static int ds310_sensor_read_byte(struct ds310_sensor *sensor, uint8_t address)
+{
+    int status = 0;
+
+    if (sensor->client == NULL)
+    {
+        return address < DS310_REGISTER_COUNT ? sensor->registers[address] : 0;
+    }
+
+    status = i2c_smbus_read_byte_data(sensor->client, address);
+    if (status >= 0)
+    {
+        atomic_set(&sensor->failures, 0);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Write a register of the ds310 sensor or of the register model
+ *        of a virtual sensor
+ */
+static int ds310_sensor_write_byte(struct ds310_sensor *sensor, uint8_t address, uint8_t value)
+{
+    int status = 0;
+
+    if (sensor->client == NULL)
+    {
+        if (address < DS310_REGISTER_COUNT)
+        {
+            sensor->registers[address] = value;
+        }
+        return 0;
+    }
+
+    status = i2c_smbus_write_byte_data(sensor->client, address, value);
+    if (status >= 0)
+    {
+        atomic_set(&sensor->failures, 0);
+
+        /* Resets and FIFO flushes are commands, not configuration */
+        if (address != DS310_RESET)
+        {
+            sensor->shadow[address] = value;
+            __set_bit(address, sensor->shadow_written);
+        }
+    }
+
+    return status;
+}
+
+/**
+ * @brief Read consecutive registers, returns the number of bytes read
+ */
+static int ds310_sensor_read_block(struct ds310_sensor *sensor, uint8_t address, uint8_t length, uint8_t *buffer)
+{
+    int status = 0;
+
+    if (sensor->client == NULL)
+    {
+        if (address + length > DS310_REGISTER_COUNT)
+        {
+            return -EINVAL;
+        }
+        memcpy(buffer, &sensor->registers[address], length);
+        return length;
+    }
+
+    status = i2c_smbus_read_i2c_block_data(sensor->client, address, length, buffer);
+    if (status >= 0)
+    {
+        atomic_set(&sensor->failures, 0);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Read the calibration coefficients of the ds310 sensor
+ */
+static int ds310_sensor_read_calibration(struct ds310_sensor *sensor)
+{
+    uint8_t buffer[DS310_COEF_LENGTH];
+    int status = 0, retries = 10;
+
+    /* Coefficients are available shortly after power up */
+    while ((status = ds310_sensor_read_byte(sensor, DS310_MEAS_CFG)) >= 0 &&
+           !(status & DS310_COEF_RDY) && --retries)
+    {
+        msleep(10);
+    }
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    status = ds310_sensor_read_block(sensor, DS310_COEF, DS310_COEF_LENGTH, buffer);
+    if (status != DS310_COEF_LENGTH)
+    {
+        return status < 0 ? status : -EIO;
+    }
+
+    sensor->calibration.c0 = sign_extend32((buffer[0] << 4) | (buffer[1] >> 4), 11);
+    sensor->calibration.c1 = sign_extend32(((buffer[1] & 0x0F) << 8) | buffer[2], 11);
+    sensor->calibration.c00 = sign_extend32((buffer[3] << 12) | (buffer[4] << 4) | (buffer[5] >> 4), 19);
+    sensor->calibration.c10 = sign_extend32(((buffer[5] & 0x0F) << 16) | (buffer[6] << 8) | buffer[7], 19);
+    sensor->calibration.c01 = sign_extend32((buffer[8] << 8) | buffer[9], 15);
+    sensor->calibration.c11 = sign_extend32((buffer[10] << 8) | buffer[11], 15);
+    sensor->calibration.c20 = sign_extend32((buffer[12] << 8) | buffer[13], 15);
+    sensor->calibration.c21 = sign_extend32((buffer[14] << 8) | buffer[15], 15);
+    sensor->calibration.c30 = sign_extend32((buffer[16] << 8) | buffer[17], 15);
+
+    return 0;
+}
+
+/**
+ * @brief Read the latest raw pressure and temperature results
+ */
+static int ds310_sensor_read_raw(struct ds310_sensor *sensor, s32 *pressure_raw, s32 *temperature_raw)
+{
+    uint8_t buffer[DS310_RESULT_LENGTH];
+    int status = ds310_sensor_read_block(sensor, DS310_PSR_B2, DS310_RESULT_LENGTH, buffer);
+
+    if (status != DS310_RESULT_LENGTH)
+    {
+        return status < 0 ? status : -EIO;
+    }
+
+    *pressure_raw = sign_extend32((buffer[0] << 16) | (buffer[1] << 8) | buffer[2], 23);
+    *temperature_raw = sign_extend32((buffer[3] << 16) | (buffer[4] << 8) | buffer[5], 23);
+
+    return 0;
+}
+
+/**
+ * @brief Compensate raw results to millipascal and millidegree Celsius
+ */
+static void ds310_sensor_compensate(struct ds310_sensor *sensor, s32 pressure_raw, s32 temperature_raw, s32 *pressure, s32 *temperature)
+{
+    struct ds310_sensor_calibration *c = &sensor->calibration;
+    s32 kp = ds310_sensor_scale_factors[sensor->prs_cfg & DS310_OVERSAMPLING_MASK];
+    s32 kt = ds310_sensor_scale_factors[sensor->tmp_cfg & DS310_OVERSAMPLING_MASK];
+    s64 ps, ts, value, temperature_term;
+
+    /* Scaled raw values in Q30 */
+    ps = div_s64((s64)pressure_raw << 30, kp);
+    ts = div_s64((s64)temperature_raw << 30, kt);
+
+    /* T = c0 * 0.5 + c1 * Traw_sc */
+    value = ((s64)c->c0 << 29) + c->c1 * ts;
+    *temperature = (value * 1000) >> 30;
+
+    /* P = c00 + Praw_sc * (c10 + Praw_sc * (c20 + Praw_sc * c30))
+     *     + Traw_sc * (c01 + Praw_sc * (c11 + Praw_sc * c21)) */
+    value = ((s64)c->c20 << 30) + ds310_sensor_mul_q30(ps, (s64)c->c30 << 30);
+    value = ((s64)c->c10 << 30) + ds310_sensor_mul_q30(ps, value);
+    value = ((s64)c->c00 << 30) + ds310_sensor_mul_q30(ps, value);
+    temperature_term = ((s64)c->c11 << 30) + ds310_sensor_mul_q30(ps, (s64)c->c21 << 30);
+    temperature_term = ((s64)c->c01 << 30) + ds310_sensor_mul_q30(ps, temperature_term);
+    value += ds310_sensor_mul_q30(ts, temperature_term);
+    *pressure = (value * 1000) >> 30;
+}
+
+/**
+ * @brief Convert pressure in millipascal to altitude in millimetres
+ *        relative to the configured sea level pressure
+ */
+static s32 ds310_sensor_altitude(struct ds310_sensor *sensor, s32 pressure)
+{
+    s64 ratio, step, fraction;
+    s32 low, high;
+
+    if (pressure <= 0)
+    {
+        pressure = 0;
+    }
+
+    /* Pressure ratio in Q24, clamped to the table range */
+    ratio = div64_u64((u64)pressure << DS310_ALTITUDE_RATIO_SHIFT, (u64)sensor->sea_level_pressure * 1000);
+    ratio = clamp_t(s64, ratio - DS310_ALTITUDE_RATIO_MIN, 0,
+                    ((s64)ARRAY_SIZE(ds310_altitude_table) - 1) << DS310_ALTITUDE_STEP_SHIFT);
+
+    step = ratio >> DS310_ALTITUDE_STEP_SHIFT;
+    fraction = ratio & ((1 << DS310_ALTITUDE_STEP_SHIFT) - 1);
+    low = ds310_altitude_table[step];
+    high = step + 1 < ARRAY_SIZE(ds310_altitude_table) ? ds310_altitude_table[step + 1] : low;
+
+    return low + (s32)div_s64((s64)(high - low) * fraction, 1 << DS310_ALTITUDE_STEP_SHIFT);
+}
+
+/**
+ * @brief Read and compensate the latest pressure and temperature
+ */
+static int ds310_sensor_measure(struct ds310_sensor *sensor, s32 *pressure, s32 *temperature)
+{
+    s32 pressure_raw = 0, temperature_raw = 0;
+    int status = 0;
+
+    mutex_lock(&sensor->lock);
+    status = ds310_sensor_read_raw(sensor, &pressure_raw, &temperature_raw);
+    if (status == 0)
+    {
+        ds310_sensor_compensate(sensor, pressure_raw, temperature_raw, pressure, temperature);
+    }
+    mutex_unlock(&sensor->lock);
+
+    return status;
+}
+
+/**
+ * @brief Read all registers in block transfers
+ */
+static int ds310_sensor_read_registers(struct ds310_sensor *sensor, struct ds310_registers *registers)
+{
+    uint8_t address, length;
+    int status = 0;
+
+    mutex_lock(&sensor->lock);
+    if (sensor->gone)
+    {
+        mutex_unlock(&sensor->lock);
+        return -ENODEV;
+    }
+
+    for (address = 0; address < DS310_REGISTER_COUNT; address += length)
+    {
+        length = min(DS310_REGISTER_COUNT - address, DS310_BLOCK_LENGTH);
+        status = ds310_sensor_read_block(sensor, address, length, &registers->values[address]);
+        if (status != length)
+        {
+            status = status < 0 ? status : -EIO;
+            break;
+        }
+        status = 0;
+    }
+    mutex_unlock(&sensor->lock);
+
+    return status;
+}
+
+/**
+ * @brief Show compensated pressure in millipascal
+ */
+static ssize_t ds310_sensor_pressure_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    s32 pressure = 0, temperature = 0;
+    int status = ds310_sensor_measure(sensor, &pressure, &temperature);
+
+    return status < 0 ? status : sysfs_emit(buf, "%d\n", pressure);
+}
+
+/**
+ * @brief Show compensated temperature in millidegree Celsius
+ */
+static ssize_t ds310_sensor_temperature_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    s32 pressure = 0, temperature = 0;
+    int status = ds310_sensor_measure(sensor, &pressure, &temperature);
+
+    return status < 0 ? status : sysfs_emit(buf, "%d\n", temperature);
+}
+
+/**
+ * @brief Show altitude in millimetres relative to the sea level pressure
+ */
+static ssize_t ds310_sensor_altitude_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    s32 pressure = 0, temperature = 0;
+    int status = ds310_sensor_measure(sensor, &pressure, &temperature);
+
+    return status < 0 ? status : sysfs_emit(buf, "%d\n", ds310_sensor_altitude(sensor, pressure));
+}
+
+/**
+ * @brief Show sea level reference pressure in pascal
+ */
+static ssize_t ds310_sensor_sea_level_pressure_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", sensor->sea_level_pressure);
+}
+
+/**
+ * @brief Set sea level reference pressure in pascal
+ */
+static ssize_t ds310_sensor_sea_level_pressure_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    u32 value = 0;
+    int status = kstrtou32(buf, 10, &value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (value == 0 || value > 2 * DS310_SEA_LEVEL_PRESSURE)
+    {
+        return -EINVAL;
+    }
+
+    sensor->sea_level_pressure = value;
+
+    return count;
+}
+
+/**
+ * @brief Current time in the timestamp clock of the sensor, usable in
+ *        hard interrupt context
+ */
+static u64 ds310_sensor_timestamp(struct ds310_sensor *sensor)
+{
+    switch (READ_ONCE(sensor->timestamp_clock))
+    {
+    case CLOCK_REALTIME:
+        return ktime_get_real_ns();
+    case CLOCK_MONOTONIC_RAW:
+        return ktime_get_raw_ns();
+    case CLOCK_BOOTTIME:
+        return ktime_get_boottime_ns();
+    case CLOCK_TAI:
+        return ktime_get_clocktai_ns();
+    default:
+        return ktime_get_ns();
+    }
+}
+
+/**
+ * Names of the selectable timestamp clocks, as in IIO
+ */
+static const struct
+{
+    clockid_t clock;
+    const char *name;
+} ds310_sensor_clocks[] = {
+    { CLOCK_REALTIME, "realtime" },
+    { CLOCK_MONOTONIC, "monotonic" },
+    { CLOCK_MONOTONIC_RAW, "monotonic_raw" },
+    { CLOCK_BOOTTIME, "boottime" },
+    { CLOCK_TAI, "tai" },
+};
+
+/**
+ * @brief Show the clock of the sample timestamps
+ */
+static ssize_t ds310_sensor_current_timestamp_clock_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    size_t i = 0;
+
+    for (i = 0; i < ARRAY_SIZE(ds310_sensor_clocks); i++)
+    {
+        if (ds310_sensor_clocks[i].clock == READ_ONCE(sensor->timestamp_clock))
+        {
+            return sysfs_emit(buf, "%s\n", ds310_sensor_clocks[i].name);
+        }
+    }
+
+    return -EINVAL;
+}
+
+/**
+ * @brief Select the clock of the sample timestamps, fails with EBUSY
+ *        while a reader is streaming
+ */
+static ssize_t ds310_sensor_current_timestamp_clock_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    int status = -EINVAL;
+    size_t i = 0;
+
+    for (i = 0; i < ARRAY_SIZE(ds310_sensor_clocks); i++)
+    {
+        if (sysfs_streq(buf, ds310_sensor_clocks[i].name))
+        {
+            break;
+        }
+    }
+
+    if (i == ARRAY_SIZE(ds310_sensor_clocks))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&sensor->lock);
+    if (atomic_read(&sensor->stream.readers) > 0)
+    {
+        status = -EBUSY;
+    }
+    else
+    {
+        WRITE_ONCE(sensor->timestamp_clock, ds310_sensor_clocks[i].clock);
+        status = 0;
+    }
+    mutex_unlock(&sensor->lock);
+
+    return status < 0 ? status : count;
+}
+
+/**
+ * @brief Run a task with SCHED_FIFO priority, or SCHED_NORMAL for 0
+ */
+static int ds310_sensor_set_priority(struct task_struct *task, int priority)
+{
+    struct sched_attr attr = { .size = sizeof(attr) };
+
+    attr.sched_policy = priority > 0 ? SCHED_FIFO : SCHED_NORMAL;
+    attr.sched_priority = max(priority, 0);
+
+    return sched_setattr_nocheck(task, &attr);
+}
+
+/**
+ * @brief Apply CPU and priority settings to the acquisition
+ *
+ * The interrupt thread follows the affinity of its interrupt and applies
+ * a new priority itself on its next run. The acquisition thread of an
+ * interrupt sensor runs the batched mode with the same settings.
+ */
+static int ds310_sensor_apply_placement(struct ds310_sensor *sensor)
+{
+    const struct cpumask *mask = sensor->acquisition_cpu < 0 ? cpu_possible_mask : cpumask_of(sensor->acquisition_cpu);
+    int status = 0;
+
+    if (sensor->irq > 0)
+    {
+        atomic_set(&sensor->priority_pending, 1);
+        status = irq_set_affinity(sensor->irq, mask);
+        if (status < 0)
+        {
+            return status;
+        }
+    }
+
+    status = ds310_sensor_set_priority(sensor->stream.thread, sensor->acquisition_priority);
+    if (status < 0)
+    {
+        return status;
+    }
+
+    return set_cpus_allowed_ptr(sensor->stream.thread, mask);
+}
+
+/**
+ * @brief Lock protecting the placement settings of a sensor
+ *
+ * Polled sensors on one adapter share the thread of their bus, the bus
+ * lock covers the settings of all of them.
+ */
+static struct mutex *ds310_sensor_placement_lock(struct ds310_sensor *sensor)
+{
+    return sensor->bus ? &sensor->bus->lock : &sensor->lock;
+}
+
+/**
+ * @brief Copy the placement settings of a sensor to the other sensors
+ *        sharing its bus thread, the caller holds the placement lock
+ */
+static void ds310_sensor_share_placement(struct ds310_sensor *sensor)
+{
+    struct ds310_sensor *entry = NULL;
+
+    if (sensor->bus == NULL)
+    {
+        return;
+    }
+
+    list_for_each_entry(entry, &sensor->bus->sensors, bus_node)
+    {
+        WRITE_ONCE(entry->acquisition_cpu, sensor->acquisition_cpu);
+        WRITE_ONCE(entry->acquisition_priority, sensor->acquisition_priority);
+    }
+}
+
+/**
+ * @brief Show the CPU of the acquisition, -1 for any
+ */
+static ssize_t ds310_sensor_acquisition_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(sensor->acquisition_cpu));
+}
+
+/**
+ * @brief Pin the acquisition to an online CPU, -1 for any
+ */
+static ssize_t ds310_sensor_acquisition_cpu_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    struct mutex *lock = NULL;
+    int value = 0, previous = 0;
+    int status = kstrtoint(buf, 10, &value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (value < -1 || (value >= 0 && (value >= nr_cpu_ids || !cpu_online(value))))
+    {
+        return -EINVAL;
+    }
+
+    lock = ds310_sensor_placement_lock(sensor);
+    mutex_lock(lock);
+    previous = sensor->acquisition_cpu;
+    WRITE_ONCE(sensor->acquisition_cpu, value);
+    status = ds310_sensor_apply_placement(sensor);
+    if (status < 0)
+    {
+        WRITE_ONCE(sensor->acquisition_cpu, previous);
+    }
+    else
+    {
+        ds310_sensor_share_placement(sensor);
+    }
+    mutex_unlock(lock);
+
+    return status < 0 ? status : count;
+}
+
+/**
+ * @brief Show the SCHED_FIFO priority of the acquisition, 0 for SCHED_NORMAL
+ */
+static ssize_t ds310_sensor_acquisition_priority_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(sensor->acquisition_priority));
+}
+
+/**
+ * @brief Set the SCHED_FIFO priority of the acquisition, 0 for SCHED_NORMAL
+ */
+static ssize_t ds310_sensor_acquisition_priority_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    struct mutex *lock = NULL;
+    int value = 0, previous = 0;
+    int status = kstrtoint(buf, 10, &value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (value < 0 || value >= MAX_RT_PRIO)
+    {
+        return -EINVAL;
+    }
+
+    lock = ds310_sensor_placement_lock(sensor);
+    mutex_lock(lock);
+    previous = sensor->acquisition_priority;
+    WRITE_ONCE(sensor->acquisition_priority, value);
+    status = ds310_sensor_apply_placement(sensor);
+    if (status < 0)
+    {
+        WRITE_ONCE(sensor->acquisition_priority, previous);
+    }
+    else
+    {
+        ds310_sensor_share_placement(sensor);
+    }
+    mutex_unlock(lock);
+
+    return status < 0 ? status : count;
+}
+
+/**
+ * @brief Show how samples are acquired: polling, interrupt or batched
+ */
+static ssize_t ds310_sensor_acquisition_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+
+    if (sensor->irq <= 0)
+    {
+        return sysfs_emit(buf, "polling\n");
+    }
+
+    return sysfs_emit(buf, "%s\n", READ_ONCE(sensor->batched) ? "batched" : "interrupt");
+}
+
+/**
+ * @brief Ring slot of sample number index
+ */
+static struct ds310_sample *ds310_sensor_slot(struct ds310_sensor *sensor, u64 index)
+{
+    return &sensor->stream.samples[index & (sensor->stream.size - 1)];
+}
+
+/**
+ * @brief Number of samples written to the stream
+ */
+static u64 ds310_sensor_head(struct ds310_sensor *sensor)
+{
+    return atomic64_read_acquire(&sensor->stream.head);
+}
+
+/**
+ * @brief Oldest sample number that was certainly not overwritten while
+ *        samples were copied, to be called after the copy
+ *
+ * The producer publishes sample n before it starts overwriting sample
+ * n + 1 - size, so a copy is intact if its sample number is above the
+ * head read afterwards minus the ring size.
+ */
+static u64 ds310_sensor_oldest_valid(struct ds310_sensor *sensor)
+{
+    u64 head;
+
+    smp_rmb();
+    head = atomic64_read(&sensor->stream.head);
+
+    return head >= sensor->stream.size ? head - sensor->stream.size + 1 : 0;
+}
+
+/**
+ * @brief Append samples to the stream and wake up the readers
+ *
+ * The caller holds the sensor lock, which serializes the acquisition and
+ * the configuration markers of write(), ioctl() and netlink requests as
+ * producers. Readers never take it, so the producer never waits for a
+ * reader. The records are numbered with their position in the stream,
+ * and pending flags such as a preceding gap go to the next sample. Every
+ * record is traced before it is published.
+ */
+static void ds310_sensor_push_samples(struct ds310_sensor *sensor, const struct ds310_sample *samples, size_t count)
+{
+    struct ds310_sample *slot = NULL;
+    u64 head = atomic64_read(&sensor->stream.head);
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        slot = ds310_sensor_slot(sensor, head);
+        *slot = samples[i];
+        slot->sequence = head;
+        if (!(slot->flags & DS310_SAMPLE_CONFIG) && atomic_read(&sensor->sample_flags))
+        {
+            slot->flags |= atomic_xchg(&sensor->sample_flags, 0);
+        }
+        trace_ds310_sample(sensor->minor, slot);
+
+        /* Publish the sample, then order the next overwrite after it */
+        atomic64_set_release(&sensor->stream.head, ++head);
+        smp_store_release(&sensor->stream.ring->head, (u32)head);
+        smp_wmb();
+    }
+
+    if (wq_has_sleeper(&sensor->stream.wait))
+    {
+        wake_up_interruptible(&sensor->stream.wait);
+    }
+
+    /* ds310_all readers wait for new samples of any sensor */
+    if (atomic_read(&ds310_sensor_aggregate_readers) > 0)
+    {
+        atomic_long_inc(&ds310_sensor_aggregate_generation);
+        if (wq_has_sleeper(&ds310_sensor_aggregate_wait))
+        {
+            wake_up_interruptible(&ds310_sensor_aggregate_wait);
+        }
+    }
+}
+
+/**
+ * @brief Current configuration and scale factors of a sensor, the caller
+ *        holds the sensor lock
+ */
+static void ds310_sensor_get_config(struct ds310_sensor *sensor, struct ds310_config_marker *marker)
+{
+    const uint8_t *registers = sensor->client ? sensor->shadow : sensor->registers;
+
+    marker->kp = ds310_sensor_scale_factors[sensor->prs_cfg & DS310_OVERSAMPLING_MASK];
+    marker->kt = ds310_sensor_scale_factors[sensor->tmp_cfg & DS310_OVERSAMPLING_MASK];
+    marker->prs_cfg = sensor->prs_cfg;
+    marker->tmp_cfg = sensor->tmp_cfg;
+    marker->meas_cfg = registers[DS310_MEAS_CFG] & DS310_MEAS_CTRL_MASK;
+    marker->cfg_reg = registers[DS310_CFG_REG];
+}
+
+/**
+ * @brief Append a configuration marker to the stream
+ *
+ * Called with the sensor lock held after a configuration register was
+ * written, so the marker lands between the samples measured before and
+ * after the change and buffered samples stay as they are.
+ */
+static void ds310_sensor_push_config(struct ds310_sensor *sensor)
+{
+    union
+    {
+        struct ds310_sample sample;
+        struct ds310_config_marker marker;
+    } record = {0};
+
+    BUILD_BUG_ON(sizeof(struct ds310_config_marker) != sizeof(struct ds310_sample));
+    BUILD_BUG_ON(offsetof(struct ds310_config_marker, flags) != offsetof(struct ds310_sample, flags));
+
+    record.marker.timestamp = ds310_sensor_timestamp(sensor);
+    ds310_sensor_get_config(sensor, &record.marker);
+    record.marker.flags = DS310_SAMPLE_CONFIG;
+
+    ds310_sensor_push_samples(sensor, &record.sample, 1);
+}
+
+/**
+ * @brief Write a register on behalf of the user space, the caller holds
+ *        the sensor lock
+ *
+ * Tracks the oversampling rates used for compensation and marks changes
+ * of the configuration in the stream.
+ */
+static int ds310_sensor_configure(struct ds310_sensor *sensor, uint8_t address, uint8_t value)
+{
+    int status = ds310_sensor_write_byte(sensor, address, value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (address == DS310_PRS_CFG)
+    {
+        sensor->prs_cfg = value;
+    }
+    else if (address == DS310_TMP_CFG)
+    {
+        sensor->tmp_cfg = value;
+    }
+
+    /* Tell streaming readers which samples the new configuration applies to */
+    if (address == DS310_PRS_CFG || address == DS310_TMP_CFG || address == DS310_MEAS_CFG || address == DS310_CFG_REG)
+    {
+        ds310_sensor_push_config(sensor);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Skip samples a reader lost to the producer
+ */
+static void ds310_sensor_skip_samples(struct ds310_sensor_reader *reader, u64 count)
+{
+    reader->tail += count;
+    reader->dropped += count;
+    reader->overrun = true;
+    reader->key_pending = true;
+    if (DS310_FEATURE_STATS)
+    {
+        atomic64_inc(&reader->sensor->stream.overruns);
+    }
+}
+
+/**
+ * @brief Copy up to count unread samples of a reader
+ */
+static size_t ds310_sensor_fetch_samples(struct ds310_sensor_reader *reader, struct ds310_sample *samples, size_t count)
+{
+    struct ds310_sensor *sensor = reader->sensor;
+    u64 head = 0, oldest = 0, lost = 0;
+    size_t copied = 0, i;
+
+    do
+    {
+        /* Skip samples that were overwritten before the reader got them */
+        head = ds310_sensor_head(sensor);
+        if (head - reader->tail > sensor->stream.size)
+        {
+            ds310_sensor_skip_samples(reader, head - sensor->stream.size - reader->tail);
+        }
+
+        copied = min_t(u64, count, head - reader->tail);
+        for (i = 0; i < copied; i++)
+        {
+            samples[i] = *ds310_sensor_slot(sensor, reader->tail + i);
+        }
+
+        /* Drop copies the producer overwrote meanwhile, retry if none is left */
+        oldest = ds310_sensor_oldest_valid(sensor);
+        if (reader->tail < oldest)
+        {
+            lost = min_t(u64, oldest - reader->tail, copied);
+            memmove(samples, samples + lost, (copied - lost) * sizeof(*samples));
+            copied -= lost;
+            ds310_sensor_skip_samples(reader, lost);
+        }
+    } while (copied == 0 && reader->tail != ds310_sensor_head(sensor) && count);
+
+    /* The first record after lost ones tells the reader about the gap */
+    if (copied && reader->overrun)
+    {
+        samples[0].flags |= DS310_SAMPLE_OVERRUN;
+        reader->overrun = false;
+    }
+
+    reader->tail += copied;
+
+    return copied;
+}
+
+/**
+ * @brief Count a failed bus transfer of the acquisition
+ */
+static void ds310_sensor_count_error(struct ds310_sensor *sensor)
+{
+    if (DS310_FEATURE_STATS)
+    {
+        atomic64_inc(&sensor->stream.errors);
+    }
+    atomic_or(DS310_SAMPLE_OVERRUN, &sensor->sample_flags);
+
+    /* Recover right away once the sensor stopped answering */
+    if (sensor->client != NULL && atomic_inc_return(&sensor->failures) == DS310_RECOVERY_FAILURES)
+    {
+        mod_delayed_work(system_wq, &sensor->recovery, 0);
+    }
+}
+
+/**
+ * @brief Snapshot counters and rolling statistics of buffered samples
+ */
+static void ds310_sensor_get_stats(struct ds310_sensor *sensor, struct ds310_stats *stats)
+{
+    const struct ds310_sample *sample;
+    s64 pressure_sum = 0, temperature_sum = 0;
+    u64 head = 0;
+    u32 window = 0, i;
+
+    /* The window keeps a batch of distance to the producer, retry if it caught up */
+    do
+    {
+        head = ds310_sensor_head(sensor);
+        window = min_t(u64, head, min_t(u32, DS310_STATS_WINDOW, sensor->stream.size - DS310_FETCH_BATCH));
+        pressure_sum = temperature_sum = 0;
+        stats->window = 0;
+
+        for (i = 0; i < window; i++)
+        {
+            sample = ds310_sensor_slot(sensor, head - 1 - i);
+            if (sample->flags & DS310_SAMPLE_CONFIG)
+            {
+                continue;
+            }
+
+            if (stats->window++ == 0)
+            {
+                stats->latest = *sample;
+                stats->pressure_min = stats->pressure_max = sample->pressure;
+                stats->temperature_min = stats->temperature_max = sample->temperature;
+            }
+
+            pressure_sum += sample->pressure;
+            temperature_sum += sample->temperature;
+            stats->pressure_min = min(stats->pressure_min, sample->pressure);
+            stats->pressure_max = max(stats->pressure_max, sample->pressure);
+            stats->temperature_min = min(stats->temperature_min, sample->temperature);
+            stats->temperature_max = max(stats->temperature_max, sample->temperature);
+        }
+    } while (window && head - window < ds310_sensor_oldest_valid(sensor));
+
+    stats->samples = head;
+    stats->overruns = atomic64_read(&sensor->stream.overruns);
+    stats->errors = atomic64_read(&sensor->stream.errors);
+    stats->readers = atomic_read(&sensor->stream.readers);
+    if (stats->window)
+    {
+        stats->pressure_mean = div_s64(pressure_sum, stats->window);
+        stats->temperature_mean = div_s64(temperature_sum, stats->window);
+    }
+}
+
+/**
+ * @brief Latest compensated values from the stream, measured only when
+ *        the stream has no sample of the last DS310_CACHE_MAX_AGE_MS
+ *
+ * Configuration markers at the end of the stream are skipped, up to
+ * DS310_LATEST_SCAN records.
+ */
+static int ds310_sensor_latest(struct ds310_sensor *sensor, s32 *pressure, s32 *temperature)
+{
+    struct ds310_sample sample = {0};
+    u64 head = 0, index = 0;
+
+    do
+    {
+        head = ds310_sensor_head(sensor);
+        for (index = head; index > 0 && head - index < DS310_LATEST_SCAN; index--)
+        {
+            sample = *ds310_sensor_slot(sensor, index - 1);
+            if (!(sample.flags & DS310_SAMPLE_CONFIG))
+            {
+                break;
+            }
+            sample.timestamp = 0;
+        }
+    } while (index && index - 1 < ds310_sensor_oldest_valid(sensor));
+
+    if (sample.timestamp == 0 || ds310_sensor_timestamp(sensor) - sample.timestamp > DS310_CACHE_MAX_AGE_MS * NSEC_PER_MSEC)
+    {
+        return ds310_sensor_measure(sensor, pressure, temperature);
+    }
+
+    *pressure = sample.pressure;
+    *temperature = sample.temperature;
+
+    return 0;
+}
+
+/**
+ * @brief Show only the temperature input of the hwmon device
+ */
+static umode_t ds310_sensor_hwmon_is_visible(const void *data, enum hwmon_sensor_types type, u32 attr, int channel)
+{
+    return type == hwmon_temp && attr == hwmon_temp_input ? 0444 : 0;
+}
+
+/**
+ * @brief Read the temperature in millidegree Celsius for hwmon
+ */
+static int ds310_sensor_hwmon_read(struct device *dev, enum hwmon_sensor_types type, u32 attr, int channel, long *value)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    s32 pressure = 0, temperature = 0;
+    int status = ds310_sensor_latest(sensor, &pressure, &temperature);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    *value = temperature;
+
+    return 0;
+}
+
+static const struct hwmon_channel_info *ds310_sensor_hwmon_info[] =
+{
+    HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT),
+    NULL,
+};
+
+static const struct hwmon_ops ds310_sensor_hwmon_ops =
+{
+    .is_visible = ds310_sensor_hwmon_is_visible,
+    .read = ds310_sensor_hwmon_read,
+};
+
+static const struct hwmon_chip_info ds310_sensor_hwmon_chip_info =
+{
+    .ops = &ds310_sensor_hwmon_ops,
+    .info = ds310_sensor_hwmon_info,
+};
+
+/**
+ * @brief Check if a streaming reader has data to read
+ */
+static bool ds310_sensor_readable(struct ds310_sensor_reader *reader)
+{
+    return ds310_sensor_head(reader->sensor) != reader->tail ||
+           (DS310_FEATURE_COMPRESSION && reader->pending_offset != reader->pending_length);
+}
+
+/**
+ * @brief Read, compensate and push the latest results, the caller holds
+ *        the sensor lock
+ *
+ * ready is the MEAS_CFG value read before the results, its ready flags
+ * tell which results are fresh.
+ */
+static int ds310_sensor_acquire(struct ds310_sensor *sensor, u64 timestamp, uint8_t ready)
+{
+    struct ds310_sample sample = { .timestamp = timestamp };
+    int status = ds310_sensor_read_raw(sensor, &sample.pressure_raw, &sample.temperature_raw);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (ready & DS310_PRS_RDY)
+    {
+        sample.flags |= DS310_SAMPLE_FRESH_PRESSURE;
+    }
+    if (ready & DS310_TMP_RDY)
+    {
+        sample.flags |= DS310_SAMPLE_FRESH_TEMPERATURE;
+    }
+
+    ds310_sensor_compensate(sensor, sample.pressure_raw, sample.temperature_raw, &sample.pressure, &sample.temperature);
+    ds310_sensor_push_samples(sensor, &sample, 1);
+
+    return 0;
+}
+
+/**
+ * @brief Average the sample period over the last measurements
+ *
+ * Periods longer than the slowest measurement rate are idle gaps
+ * between streams and are not averaged.
+ */
+static void ds310_sensor_track_period(struct ds310_sensor *sensor, u64 timestamp, u32 count)
+{
+    u64 period = 0;
+
+    if (sensor->rate_timestamp && timestamp > sensor->rate_timestamp && count)
+    {
+        period = div_u64(timestamp - sensor->rate_timestamp, count);
+    }
+
+    if (period && period <= 2 * NSEC_PER_SEC)
+    {
+        sensor->sample_period = sensor->sample_period ? sensor->sample_period - (sensor->sample_period >> 3) + (period >> 3) : period;
+    }
+    sensor->rate_timestamp = timestamp;
+}
+
+/**
+ * @brief Switch an interrupt sensor between data ready interrupts and
+ *        the FIFO, the caller holds the sensor lock
+ *
+ * The caller disables or enables the interrupt line around the switch.
+ */
+static int ds310_sensor_set_batched(struct ds310_sensor *sensor, bool batched)
+{
+    int status = ds310_sensor_read_byte(sensor, DS310_CFG_REG);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    status = batched ? (status & ~DS310_INT_PRS) | DS310_FIFO_EN : (status & ~DS310_FIFO_EN) | DS310_INT_PRS;
+    status = ds310_sensor_write_byte(sensor, DS310_CFG_REG, status);
+    if (status < 0)
+    {
+        return status;
+    }
+
+    /* Results left in the FIFO are older than the next interrupt */
+    if (!batched)
+    {
+        ds310_sensor_write_byte(sensor, DS310_RESET, DS310_FIFO_FLUSH);
+    }
+
+    WRITE_ONCE(sensor->batched, batched);
+
+    return 0;
+}
+
+/**
+ * @brief Drain the FIFO and push its pressure results, the caller holds
+ *        the sensor lock
+ *
+ * Each FIFO entry is one 24 bit result, pressure results have the least
+ * significant bit set. Pressure results are paired with the temperature
+ * result before them. The newest result gets the timestamp of the drain,
+ * the older ones are spaced by the measured sample period.
+ */
+static int ds310_sensor_acquire_fifo(struct ds310_sensor *sensor, u64 timestamp, u32 *count)
+{
+    struct ds310_sample *samples = sensor->fifo_samples;
+    uint8_t buffer[3];
+    u32 length = 0, i = 0, raw = 0;
+    int status = 0;
+
+    for (i = 0; i < DS310_FIFO_LENGTH; i++)
+    {
+        status = ds310_sensor_read_block(sensor, DS310_PSR_B2, sizeof(buffer), buffer);
+        if (status != sizeof(buffer))
+        {
+            return status < 0 ? status : -EIO;
+        }
+
+        raw = (buffer[0] << 16) | (buffer[1] << 8) | buffer[2];
+        if (raw == DS310_FIFO_EMPTY)
+        {
+            break;
+        }
+
+        if (raw & DS310_FIFO_PRESSURE)
+        {
+            samples[length].pressure_raw = sign_extend32(raw, 23);
+            samples[length].temperature_raw = sensor->fifo_temperature_raw;
+            samples[length].flags = DS310_SAMPLE_FIFO | DS310_SAMPLE_FRESH_PRESSURE;
+            if (sensor->fifo_temperature_fresh)
+            {
+                samples[length].flags |= DS310_SAMPLE_FRESH_TEMPERATURE;
+                sensor->fifo_temperature_fresh = false;
+            }
+            length++;
+        }
+        else
+        {
+            sensor->fifo_temperature_raw = sign_extend32(raw, 23);
+            sensor->fifo_temperature_fresh = true;
+        }
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        samples[i].timestamp = timestamp - (u64)(length - 1 - i) * sensor->sample_period;
+        samples[i].reserved = 0;
+        ds310_sensor_compensate(sensor, samples[i].pressure_raw, samples[i].temperature_raw, &samples[i].pressure, &samples[i].temperature);
+    }
+    ds310_sensor_push_samples(sensor, samples, length);
+
+    *count = length;
+
+    return 0;
+}
+
+/**
+ * @brief Drain the FIFO of a batched interrupt sensor and return to
+ *        interrupts when the rate drops or nobody streams
+ *
+ * @return microseconds until the FIFO is drained again
+ */
+static unsigned long ds310_sensor_poll_fifo(struct ds310_sensor *sensor)
+{
+    u64 timestamp = 0, period = 0;
+    u32 count = 0;
+    int status = 0;
+
+    mutex_lock(&sensor->lock);
+
+    /* The interrupt may have been enabled again since the thread woke up */
+    if (!sensor->batched)
+    {
+        mutex_unlock(&sensor->lock);
+        return max(poll_interval_ms, 1U) * USEC_PER_MSEC;
+    }
+
+    timestamp = ds310_sensor_timestamp(sensor);
+    status = ds310_sensor_acquire_fifo(sensor, timestamp, &count);
+    if (status < 0)
+    {
+        ds310_sensor_count_error(sensor);
+    }
+    else if (count)
+    {
+        ds310_sensor_track_period(sensor, timestamp, count);
+    }
+
+    /* An empty FIFO since the last results means the rate dropped */
+    period = count || !sensor->rate_timestamp ? sensor->sample_period : timestamp - sensor->rate_timestamp;
+    if (atomic_read(&sensor->stream.readers) == 0 || irq_rate_max == 0 || period > 2 * div_u64(NSEC_PER_SEC, irq_rate_max))
+    {
+        if (ds310_sensor_set_batched(sensor, false) < 0)
+        {
+            ds310_sensor_count_error(sensor);
+        }
+        else
+        {
+            enable_irq(sensor->irq);
+        }
+    }
+
+    mutex_unlock(&sensor->lock);
+
+    /* Drain half of the FIFO per pass, the temperature results fill the rest */
+    return clamp_t(u64, div_u64(sensor->sample_period * DS310_FIFO_BATCH, NSEC_PER_USEC), USEC_PER_MSEC, max(poll_interval_ms, 1U) * USEC_PER_MSEC);
+}
+
+/**
+ * @brief Drain the FIFO while an interrupt sensor is batched
+ */
+static int ds310_sensor_acquisition_thread(void *data)
+{
+    struct ds310_sensor *sensor = data;
+    unsigned long interval = 0;
+
+    while (!kthread_should_stop())
+    {
+        wait_event_interruptible(sensor->stream.acquisition_wait,
+                                 READ_ONCE(sensor->batched) || kthread_should_stop());
+        if (kthread_should_stop())
+        {
+            break;
+        }
+
+        interval = ds310_sensor_poll_fifo(sensor);
+        usleep_range(interval, interval + interval / 8);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Acquire the latest results of a polled sensor if they are new
+ */
+static void ds310_sensor_poll_results(struct ds310_sensor *sensor)
+{
+    int status = 0;
+
+    /* Ready flags are cleared when the results are read */
+    mutex_lock(&sensor->lock);
+    status = ds310_sensor_read_byte(sensor, DS310_MEAS_CFG);
+    if (status >= 0 && (status & (DS310_PRS_RDY | DS310_TMP_RDY)))
+    {
+        status = ds310_sensor_acquire(sensor, ds310_sensor_timestamp(sensor), status);
+    }
+    mutex_unlock(&sensor->lock);
+
+    if (status < 0)
+    {
+        ds310_sensor_count_error(sensor);
+    }
+}
+
+/**
+ * @brief Poll the streaming sensors of an adapter every poll_interval_ms
+ *
+ * The sensors are read back to back so the bus is busy in one burst per
+ * interval. The first sensor of a pass rotates so every sensor gets the
+ * earliest, least delayed slot in turn.
+ */
+static int ds310_sensor_bus_thread(void *data)
+{
+    struct ds310_sensor_bus *bus = data;
+    struct ds310_sensor *sensor = NULL;
+    unsigned long interval = max(poll_interval_ms, 1U) * USEC_PER_MSEC;
+
+    while (!kthread_should_stop())
+    {
+        wait_event_interruptible(bus->wait, atomic_read(&bus->streaming) > 0 || kthread_should_stop());
+        if (kthread_should_stop())
+        {
+            break;
+        }
+
+        mutex_lock(&bus->lock);
+        list_for_each_entry(sensor, &bus->sensors, bus_node)
+        {
+            /* Members of a synchronized group are measured by its trigger */
+            if (atomic_read(&sensor->stream.readers) > 0 && READ_ONCE(sensor->sync_group) == NULL)
+            {
+                ds310_sensor_poll_results(sensor);
+            }
+        }
+        list_rotate_left(&bus->sensors);
+        mutex_unlock(&bus->lock);
+
+        usleep_range(interval, interval + interval / 8);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Add a polled sensor to the thread of its adapter, starting the
+ *        thread for the first sensor
+ *
+ * Further sensors take over the CPU and priority of the thread.
+ */
+static int ds310_sensor_join_bus(struct ds310_sensor *sensor, const char *name)
+{
+    struct ds310_sensor_bus *bus = NULL, *entry = NULL;
+    struct ds310_sensor *member = NULL;
+    int status = 0;
+
+    mutex_lock(&ds310_sensor_buses_lock);
+
+    list_for_each_entry(entry, &ds310_sensor_buses, node)
+    {
+        if (entry->adapter == sensor->client->adapter)
+        {
+            bus = entry;
+            break;
+        }
+    }
+
+    if (bus == NULL)
+    {
+        bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+        if (bus == NULL)
+        {
+            mutex_unlock(&ds310_sensor_buses_lock);
+            return -ENOMEM;
+        }
+
+        bus->adapter = sensor->client->adapter;
+        mutex_init(&bus->lock);
+        INIT_LIST_HEAD(&bus->sensors);
+        atomic_set(&bus->streaming, 0);
+        init_waitqueue_head(&bus->wait);
+
+        /* The thread carries the name of the first sensor on the adapter */
+        bus->thread = kthread_run(ds310_sensor_bus_thread, bus, "%s", name);
+        if (IS_ERR(bus->thread))
+        {
+            status = PTR_ERR(bus->thread);
+            kfree(bus);
+            mutex_unlock(&ds310_sensor_buses_lock);
+            return status;
+        }
+
+        list_add_tail(&bus->node, &ds310_sensor_buses);
+    }
+
+    mutex_lock(&bus->lock);
+    member = list_first_entry_or_null(&bus->sensors, struct ds310_sensor, bus_node);
+    if (member != NULL)
+    {
+        sensor->acquisition_cpu = member->acquisition_cpu;
+        sensor->acquisition_priority = member->acquisition_priority;
+    }
+    list_add_tail(&sensor->bus_node, &bus->sensors);
+    mutex_unlock(&bus->lock);
+
+    sensor->bus = bus;
+    sensor->stream.thread = bus->thread;
+
+    mutex_unlock(&ds310_sensor_buses_lock);
+
+    return 0;
+}
+
+/**
+ * @brief Remove a polled sensor from its adapter, stopping the thread
+ *        with the last sensor
+ */
+static void ds310_sensor_leave_bus(struct ds310_sensor *sensor)
+{
+    struct ds310_sensor_bus *bus = sensor->bus;
+    bool streaming = false;
+    bool empty = false;
+
+    /* Readers still open on a removed sensor no longer keep the bus busy,
+     * readers closing later find no bus */
+    mutex_lock(&sensor->lock);
+    streaming = atomic_read(&sensor->stream.readers) > 0;
+    sensor->bus = NULL;
+    mutex_unlock(&sensor->lock);
+
+    mutex_lock(&ds310_sensor_buses_lock);
+
+    mutex_lock(&bus->lock);
+    list_del(&sensor->bus_node);
+    empty = list_empty(&bus->sensors);
+    mutex_unlock(&bus->lock);
+
+    if (streaming)
+    {
+        atomic_dec(&bus->streaming);
+    }
+
+    if (empty)
+    {
+        list_del(&bus->node);
+        kthread_stop(bus->thread);
+        kfree(bus);
+    }
+
+    mutex_unlock(&ds310_sensor_buses_lock);
+}
+
+/**
+ * @brief Take the timestamp of a data ready interrupt in the hard
+ *        interrupt context, before any scheduling latency
+ */
+static irqreturn_t ds310_sensor_irq_handler(int irq, void *data)
+{
+    struct ds310_sensor *sensor = data;
+
+    /* The line stays masked until the thread is done, nothing overwrites it */
+    sensor->irq_timestamp = ds310_sensor_timestamp(sensor);
+
+    return IRQ_WAKE_THREAD;
+}
+
+/**
+ * @brief Acknowledge a data ready interrupt and acquire the sample with
+ *        the timestamp of the hard interrupt
+ *
+ * Like NAPI, the thread hands over to batched FIFO reads in the
+ * acquisition thread when the interrupt rate exceeds irq_rate_max, and
+ * the acquisition thread hands back below half of it.
+ */
+static irqreturn_t ds310_sensor_irq_thread(int irq, void *data)
+{
+    struct ds310_sensor *sensor = data;
+    int interrupts = 0, status = 0;
+
+    mutex_lock(&sensor->lock);
+
+    if (atomic_xchg(&sensor->priority_pending, 0))
+    {
+        ds310_sensor_set_priority(current, sensor->acquisition_priority);
+    }
+
+    /* Reading the interrupt status releases the interrupt line */
+    interrupts = ds310_sensor_read_byte(sensor, DS310_INT_STS);
+    if (interrupts > 0 && (interrupts & DS310_INT_STS_PRS) && atomic_read(&sensor->stream.readers) > 0 &&
+        sensor->sync_group == NULL)
+    {
+        /* The ready flag of the temperature tells if it was measured as well */
+        status = ds310_sensor_read_byte(sensor, DS310_MEAS_CFG);
+        if (status >= 0)
+        {
+            status = ds310_sensor_acquire(sensor, sensor->irq_timestamp, status | DS310_PRS_RDY);
+        }
+        ds310_sensor_track_period(sensor, sensor->irq_timestamp, 1);
+
+        if (irq_rate_max && sensor->sample_period && sensor->sample_period < div_u64(NSEC_PER_SEC, irq_rate_max) &&
+            ds310_sensor_set_batched(sensor, true) == 0)
+        {
+            disable_irq_nosync(irq);
+            wake_up_interruptible(&sensor->stream.acquisition_wait);
+        }
+    }
+
+    mutex_unlock(&sensor->lock);
+
+    if (interrupts < 0 || status < 0)
+    {
+        ds310_sensor_count_error(sensor);
+    }
+
+    return interrupts == 0 ? IRQ_NONE : IRQ_HANDLED;
+}
+
+/**
+ * @brief Check that the configuration registers still hold the written
+ *        values, the caller holds the sensor lock
+ */
+static bool ds310_sensor_configured(struct ds310_sensor *sensor)
+{
+    static const uint8_t addresses[] = { DS310_PRS_CFG, DS310_TMP_CFG, DS310_MEAS_CFG, DS310_CFG_REG };
+    uint8_t control = sensor->shadow[DS310_MEAS_CFG] & DS310_MEAS_CTRL_MASK;
+    int status = 0;
+    size_t i = 0;
+
+    for (i = 0; i < ARRAY_SIZE(addresses); i++)
+    {
+        if (!test_bit(addresses[i], sensor->shadow_written))
+        {
+            continue;
+        }
+
+        status = ds310_sensor_read_byte(sensor, addresses[i]);
+        if (status < 0)
+        {
+            return false;
+        }
+
+        /* Commands end in idle mode, only a background mode persists */
+        if (addresses[i] == DS310_MEAS_CFG)
+        {
+            if (control >= DS310_MEAS_CTRL_BACKGROUND && (status & DS310_MEAS_CTRL_MASK) != control)
+            {
+                return false;
+            }
+        }
+        else if (status != sensor->shadow[addresses[i]])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Reset the sensor and restore the written registers, the caller
+ *        holds the sensor lock
+ */
+static int ds310_sensor_reset(struct ds310_sensor *sensor, bool hung)
+{
+    uint8_t control = sensor->shadow[DS310_MEAS_CFG] & DS310_MEAS_CTRL_MASK;
+    unsigned int address = 0, attempt = 0;
+    int status = 0;
+
+    /* Clock out a transfer the sensor still holds SDA low for */
+    if (hung)
+    {
+        i2c_recover_bus(sensor->client->adapter);
+    }
+
+    /* The sensor may reset before it acknowledges the command */
+    ds310_sensor_write_byte(sensor, DS310_RESET, DS310_SOFT_RESET);
+    msleep(DS310_RESET_DELAY_MS);
+
+    for (attempt = 0; attempt < DS310_RESET_ATTEMPTS; attempt++)
+    {
+        status = ds310_sensor_read_byte(sensor, DS310_MEAS_CFG);
+        if (status >= 0 && (status & (DS310_SENSOR_RDY | DS310_COEF_RDY)) == (DS310_SENSOR_RDY | DS310_COEF_RDY))
+        {
+            break;
+        }
+        msleep(DS310_RESET_DELAY_MS / 4);
+    }
+
+    if (attempt == DS310_RESET_ATTEMPTS)
+    {
+        return status < 0 ? status : -ETIMEDOUT;
+    }
+
+    /* The measurement starts last, with the configuration in place */
+    for_each_set_bit(address, sensor->shadow_written, 256)
+    {
+        if (address != DS310_MEAS_CFG)
+        {
+            status = ds310_sensor_write_byte(sensor, address, sensor->shadow[address]);
+            if (status < 0)
+            {
+                return status;
+            }
+        }
+    }
+
+    if (test_bit(DS310_MEAS_CFG, sensor->shadow_written) && control >= DS310_MEAS_CTRL_BACKGROUND)
+    {
+        status = ds310_sensor_write_byte(sensor, DS310_MEAS_CFG, control);
+    }
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    /* The next sample follows the gap of the recovery */
+    atomic_or(DS310_SAMPLE_RECOVERED | DS310_SAMPLE_OVERRUN, &sensor->sample_flags);
+
+    return 0;
+}
+
+/**
+ * @brief Reset a sensor after repeated transfer failures, or when it
+ *        stopped producing samples and lost its configuration
+ *
+ * Runs every DS310_WATCHDOG_INTERVAL while a reader streams, and right
+ * away after DS310_RECOVERY_FAILURES failed operations in a row.
+ */
+static void ds310_sensor_recover(struct work_struct *work)
+{
+    struct ds310_sensor *sensor = container_of(to_delayed_work(work), struct ds310_sensor, recovery);
+    bool hung = false;
+
+    mutex_lock(&sensor->lock);
+
+    hung = atomic_read(&sensor->failures) >= DS310_RECOVERY_FAILURES;
+    if (hung || (ds310_sensor_head(sensor) == sensor->watchdog_head && !ds310_sensor_configured(sensor)))
+    {
+        printk(KERN_ERR "ds310_sensor_recover: %s, resetting the sensor\n", hung ? "transfers fail" : "configuration lost");
+
+        if (ds310_sensor_reset(sensor, hung) < 0)
+        {
+            printk(KERN_ERR "ds310_sensor_recover: reset failed\n");
+        }
+        else
+        {
+            atomic_inc(&sensor->recoveries);
+        }
+
+        /* A failed reset is retried after the next failures */
+        atomic_set(&sensor->failures, 0);
+    }
+    sensor->watchdog_head = ds310_sensor_head(sensor);
+
+    mutex_unlock(&sensor->lock);
+
+    if (atomic_read(&sensor->stream.readers) > 0)
+    {
+        schedule_delayed_work(&sensor->recovery, DS310_WATCHDOG_INTERVAL);
+    }
+}
+
+/**
+ * @brief Produce the next sample of a virtual sensor from its recording
+ *        or from a slow pressure wave with noise
+ */
+static void ds310_sensor_virtual_sample(struct ds310_sensor *sensor, struct ds310_sample *sample, u64 timestamp)
+{
+    s32 noise = 0, wave = 0;
+    u32 angle = 0;
+
+    if (sensor->replay_count)
+    {
+        *sample = sensor->replay[sensor->replay_index];
+        if (++sensor->replay_index == sensor->replay_count)
+        {
+            sensor->replay_index = 0;
+        }
+    }
+    else
+    {
+        sensor->random_state = sensor->random_state * 1664525 + 1013904223;
+        noise = (s32)(sensor->random_state >> 28) - 8;
+        div_u64_rem(div_u64(timestamp, NSEC_PER_SEC / 6), 360, &angle);
+        wave = fixp_sin32(angle) >> 20;
+
+        sample->pressure_raw = DS310_VIRTUAL_PRESSURE_RAW + wave + noise;
+        sample->temperature_raw = DS310_VIRTUAL_TEMPERATURE_RAW + noise / 4;
+        ds310_sensor_compensate(sensor, sample->pressure_raw, sample->temperature_raw, &sample->pressure, &sample->temperature);
+    }
+
+    /* Replayed records are fresh samples, even if the recording held markers */
+    sample->timestamp = timestamp;
+    sample->flags = DS310_SAMPLE_FRESH_PRESSURE | DS310_SAMPLE_FRESH_TEMPERATURE;
+    sample->reserved = 0;
+
+    /* Keep the result registers of the register model current */
+    sensor->registers[DS310_PSR_B2] = sample->pressure_raw >> 16;
+    sensor->registers[DS310_PSR_B2 + 1] = sample->pressure_raw >> 8;
+    sensor->registers[DS310_PSR_B2 + 2] = sample->pressure_raw;
+    sensor->registers[DS310_TMP_B2] = sample->temperature_raw >> 16;
+    sensor->registers[DS310_TMP_B2 + 1] = sample->temperature_raw >> 8;
+    sensor->registers[DS310_TMP_B2 + 2] = sample->temperature_raw;
+}
+
+/**
+ * @brief Produce samples of a virtual sensor at virtual_rate_hz while at
+ *        least one reader is streaming
+ */
+static int ds310_sensor_virtual_thread(void *data)
+{
+    struct ds310_sensor *sensor = data;
+    struct ds310_sample samples[DS310_FETCH_BATCH];
+    u64 period = div_u64(NSEC_PER_SEC, clamp(virtual_rate_hz, 1U, (unsigned int)DS310_VIRTUAL_RATE_MAX));
+    u64 next = 0, now = 0, sleep_us = 0, offset = 0;
+    size_t count = 0;
+
+    while (!kthread_should_stop())
+    {
+        if (atomic_read(&sensor->stream.readers) == 0)
+        {
+            wait_event_interruptible(sensor->stream.acquisition_wait,
+                                     atomic_read(&sensor->stream.readers) > 0 || kthread_should_stop());
+
+            /* Restart the schedule after idling */
+            next = ktime_get_ns();
+            continue;
+        }
+
+        /* Skip ahead instead of catching up after a long stall */
+        now = ktime_get_ns();
+        if (now > next + NSEC_PER_SEC)
+        {
+            next = now;
+            atomic_or(DS310_SAMPLE_OVERRUN, &sensor->sample_flags);
+        }
+
+        /* Produce every sample that is due, in batches, the schedule runs on CLOCK_MONOTONIC */
+        mutex_lock(&sensor->lock);
+        offset = ds310_sensor_timestamp(sensor) - now;
+        while (next <= now)
+        {
+            for (count = 0; count < DS310_FETCH_BATCH && next <= now; count++, next += period)
+            {
+                ds310_sensor_virtual_sample(sensor, &samples[count], next + offset);
+            }
+            ds310_sensor_push_samples(sensor, samples, count);
+        }
+        mutex_unlock(&sensor->lock);
+
+        /* High rates are produced in batches of at least DS310_VIRTUAL_BATCH_US */
+        sleep_us = max_t(u64, div_u64(next - now, NSEC_PER_USEC), DS310_VIRTUAL_BATCH_US);
+        usleep_range(sleep_us, sleep_us + sleep_us / 8);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write value as little endian base 128 varint
+ */
+static size_t ds310_sensor_put_varint(uint8_t *buffer, u64 value)
+{
+    size_t length = 0;
+
+    while (value >= 0x80)
+    {
+        buffer[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = value;
+
+    return length;
+}
+
+/**
+ * @brief Map signed value to unsigned so small magnitudes stay small
+ */
+static u64 ds310_sensor_zigzag(s64 value)
+{
+    return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+/**
+ * @brief Encode a configuration marker as config frame, the next
+ *        sample is sent as key frame
+ */
+static size_t ds310_sensor_encode_config(struct ds310_sensor_reader *reader, const struct ds310_config_marker *marker, uint8_t *frame)
+{
+    size_t length = 0;
+
+    frame[length++] = DS310_CONFIG_FRAME_TAG;
+    frame[length++] = DS310_CONFIG_FRAME_MAGIC0;
+    frame[length++] = DS310_CONFIG_FRAME_MAGIC1;
+    frame[length++] = marker->prs_cfg;
+    frame[length++] = marker->tmp_cfg;
+    frame[length++] = marker->meas_cfg;
+    frame[length++] = marker->cfg_reg;
+    length += ds310_sensor_put_varint(frame + length, marker->timestamp);
+    length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag(marker->kp));
+    length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag(marker->kt));
+
+    reader->key_pending = true;
+
+    return length;
+}
+
+/**
+ * @brief Encode a sample as key frame or delta frame of the
+ *        compressed stream
+ */
+static size_t ds310_sensor_encode_sample(struct ds310_sensor_reader *reader, const struct ds310_sample *sample, uint8_t *frame)
+{
+    size_t length = 0;
+    s64 delta = 0;
+
+    if (sample->flags & DS310_SAMPLE_CONFIG)
+    {
+        return ds310_sensor_encode_config(reader, (const struct ds310_config_marker *)sample, frame);
+    }
+
+    /* Gaps of the producer, a failed acquisition or a reset, restart the deltas as well */
+    if (sample->flags & (DS310_SAMPLE_OVERRUN | DS310_SAMPLE_RECOVERED))
+    {
+        reader->key_pending = true;
+    }
+
+    if (reader->key_pending || reader->frames_since_key >= DS310_KEY_FRAME_INTERVAL)
+    {
+        frame[length++] = DS310_KEY_FRAME_TAG;
+        frame[length++] = DS310_KEY_FRAME_MAGIC0;
+        frame[length++] = DS310_KEY_FRAME_MAGIC1;
+        length += ds310_sensor_put_varint(frame + length, sample->timestamp);
+        length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag(sample->pressure_raw));
+        length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag(sample->temperature_raw));
+
+        reader->key_pending = false;
+        reader->frames_since_key = 0;
+    }
+    else
+    {
+        delta = sample->timestamp - reader->last.timestamp;
+        length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag(delta - reader->last_delta) << 1);
+        length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag((s64)sample->pressure_raw - reader->last.pressure_raw));
+        length += ds310_sensor_put_varint(frame + length, ds310_sensor_zigzag((s64)sample->temperature_raw - reader->last.temperature_raw));
+    }
+
+    reader->last = *sample;
+    reader->last_delta = delta;
+    reader->frames_since_key++;
+
+    return length;
+}
+
+/**
+ * @brief Send sample records to the user space
+ */
+static ssize_t ds310_sensor_read_records(struct ds310_sensor_reader *reader, char __user *user_buffer, size_t length)
+{
+    size_t copied = 0, count = 0;
+
+    if (length < sizeof(struct ds310_sample))
+    {
+        return -EINVAL;
+    }
+
+    while (length - copied >= sizeof(struct ds310_sample))
+    {
+        count = ds310_sensor_fetch_samples(reader, reader->batch,
+                                           min_t(size_t, DS310_READ_BATCH, (length - copied) / sizeof(struct ds310_sample)));
+        if (count == 0)
+        {
+            break;
+        }
+
+        if (copy_to_user(user_buffer + copied, reader->batch, count * sizeof(struct ds310_sample)))
+        {
+            return -EFAULT;
+        }
+        copied += count * sizeof(struct ds310_sample);
+    }
+
+    return copied;
+}
+
+/**
+ * @brief Send the compressed sample stream to the user space
+ */
+static ssize_t ds310_sensor_read_compressed(struct ds310_sensor_reader *reader, char __user *user_buffer, size_t length)
+{
+    size_t copied = 0, count = 0, chunk = 0, i;
+
+    while (copied < length)
+    {
+        /* Encode the next batch once the previous one is consumed */
+        if (reader->pending_offset == reader->pending_length)
+        {
+            reader->pending_offset = 0;
+            reader->pending_length = 0;
+
+            count = ds310_sensor_fetch_samples(reader, reader->batch, DS310_FETCH_BATCH);
+            if (count == 0)
+            {
+                break;
+            }
+
+            for (i = 0; i < count; i++)
+            {
+                reader->pending_length += ds310_sensor_encode_sample(reader, &reader->batch[i], reader->pending + reader->pending_length);
+            }
+        }
+
+        chunk = min(length - copied, reader->pending_length - reader->pending_offset);
+        if (copy_to_user(user_buffer + copied, reader->pending + reader->pending_offset, chunk))
+        {
+            return -EFAULT;
+        }
+        reader->pending_offset += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+/**
+ * @brief Start or stop streaming samples to a reader
+ */
+static int ds310_sensor_set_format(struct ds310_sensor_reader *reader, u32 format)
+{
+    struct ds310_sensor *sensor = reader->sensor;
+    bool streaming = reader->format != DS310_FORMAT_REGISTER;
+
+    if (format > DS310_FORMAT_COMPRESSED || (format == DS310_FORMAT_COMPRESSED && !DS310_FEATURE_COMPRESSION))
+    {
+        return -EINVAL;
+    }
+
+    /* Removal stops the acquisition and the bus under the sensor lock */
+    mutex_lock(&sensor->lock);
+
+    if (!streaming && format != DS310_FORMAT_REGISTER)
+    {
+        if (sensor->gone)
+        {
+            mutex_unlock(&sensor->lock);
+            return -ENODEV;
+        }
+
+        reader->tail = ds310_sensor_head(sensor);
+
+        if (atomic_inc_return(&sensor->stream.readers) == 1)
+        {
+            if (sensor->client != NULL)
+            {
+                schedule_delayed_work(&sensor->recovery, DS310_WATCHDOG_INTERVAL);
+            }
+            if (sensor->bus)
+            {
+                atomic_inc(&sensor->bus->streaming);
+                wake_up_interruptible(&sensor->bus->wait);
+            }
+            wake_up_interruptible(&sensor->stream.acquisition_wait);
+        }
+    }
+    else if (streaming && format == DS310_FORMAT_REGISTER)
+    {
+        if (atomic_dec_return(&sensor->stream.readers) == 0 && sensor->bus)
+        {
+            atomic_dec(&sensor->bus->streaming);
+        }
+    }
+
+    mutex_unlock(&sensor->lock);
+
+    /* Every stream starts with a key frame */
+    WRITE_ONCE(reader->format, format);
+    reader->key_pending = true;
+    reader->pending_length = 0;
+    reader->pending_offset = 0;
+
+    /* A read blocked on the descriptor returns to the register protocol */
+    if (streaming && format == DS310_FORMAT_REGISTER)
+    {
+        wake_up_interruptible(&sensor->stream.wait);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Replace the recording replayed by a virtual sensor, an empty
+ *        recording selects the synthetic generator
+ */
+static int ds310_sensor_load_replay(struct ds310_sensor *sensor, const struct ds310_replay __user *argument)
+{
+    struct ds310_sample *samples = NULL, *previous = NULL;
+    struct ds310_replay replay;
+
+    if (sensor->client != NULL)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    if (copy_from_user(&replay, argument, sizeof(replay)))
+    {
+        return -EFAULT;
+    }
+
+    if (replay.reserved != 0)
+    {
+        return -EINVAL;
+    }
+
+    if (replay.count > DS310_REPLAY_MAX_SAMPLES)
+    {
+        return -E2BIG;
+    }
+
+    if (replay.count)
+    {
+        samples = kvmalloc_array(replay.count, sizeof(*samples), GFP_KERNEL);
+        if (samples == NULL)
+        {
+            return -ENOMEM;
+        }
+
+        if (copy_from_user(samples, u64_to_user_ptr(replay.samples), replay.count * sizeof(*samples)))
+        {
+            kvfree(samples);
+            return -EFAULT;
+        }
+    }
+
+    mutex_lock(&sensor->lock);
+    previous = sensor->replay;
+    sensor->replay = samples;
+    sensor->replay_count = replay.count;
+    sensor->replay_index = 0;
+    mutex_unlock(&sensor->lock);
+
+    kvfree(previous);
+
+    return 0;
+}
+
+/**
+ * @brief Free a sensor with its last reference, after the removal and
+ *        the last close of its device file
+ */
+static void ds310_sensor_free(struct kref *refcount)
+{
+    struct ds310_sensor *sensor = container_of(refcount, struct ds310_sensor, refcount);
+
+    vfree(sensor->stream.ring);
+    kvfree(sensor->replay);
+    kfree(sensor->fifo_samples);
+    kfree(sensor);
+}
+
+/**
+ * @brief This function is called, when the ds310 sensor device
+ *       file is opened
+ */
+static int ds310_sensor_open(struct inode *inode, struct file *device_file)
+{
+    struct ds310_sensor_reader *reader = NULL;
+    struct ds310_sensor *sensor = NULL;
+
+    printk(KERN_INFO "ds310_sensor_open\n");
+
+    reader = kvzalloc(sizeof(*reader), GFP_KERNEL);
+    if (reader == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    /* A sensor being removed leaves the table first */
+    mutex_lock(&ds310_sensor_table_lock);
+    sensor = ds310_sensor_table[iminor(inode)];
+    if (sensor != NULL)
+    {
+        kref_get(&sensor->refcount);
+    }
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    if (sensor == NULL)
+    {
+        kvfree(reader);
+        return -ENODEV;
+    }
+
+    reader->sensor = sensor;
+    mutex_init(&reader->lock);
+    reader->format = DS310_FORMAT_REGISTER;
+    device_file->private_data = reader;
+
+    return 0;
+}
+
+/**
+ * @brief This function is called, when the ds310 sensor device
+ *       file is closed
+ */
+static int ds310_sensor_release(struct inode *inode, struct file *device_file)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+
+    printk(KERN_INFO "ds310_sensor_release\n");
+
+    ds310_sensor_set_format(reader, DS310_FORMAT_REGISTER);
+    kref_put(&reader->sensor->refcount, ds310_sensor_free);
+    kvfree(reader);
+
+    return 0;
+}
+
+/**
+ * @brief Send ds310 sensor register value or samples to the user space
+ */
+static ssize_t ds310_sensor_read(struct file *device_file, char __user *user_buffer, size_t length, loff_t *offset)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+    struct ds310_sensor *sensor = reader->sensor;
+    ssize_t status = 0;
+
+    /* Threads sharing the file descriptor share its stream position */
+    if (mutex_lock_interruptible(&reader->lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    /* Block until samples are available, without the lock so writes,
+     * ioctls and seeks on the same file descriptor are not held up */
+    while (reader->format != DS310_FORMAT_REGISTER && !ds310_sensor_readable(reader))
+    {
+        mutex_unlock(&reader->lock);
+
+        /* No more samples follow the removal of the sensor */
+        if (READ_ONCE(sensor->gone))
+        {
+            return -ENODEV;
+        }
+
+        if (device_file->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(sensor->stream.wait,
+                                     ds310_sensor_readable(reader) || READ_ONCE(reader->format) == DS310_FORMAT_REGISTER ||
+                                     READ_ONCE(sensor->gone)) ||
+            mutex_lock_interruptible(&reader->lock))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if (reader->format != DS310_FORMAT_REGISTER)
+    {
+        if (!DS310_FEATURE_COMPRESSION || reader->format == DS310_FORMAT_RECORD)
+        {
+            status = ds310_sensor_read_records(reader, user_buffer, length);
+        }
+        else
+        {
+            status = ds310_sensor_read_compressed(reader, user_buffer, length);
+        }
+
+        mutex_unlock(&reader->lock);
+        return status;
+    }
+
+    if (!DS310_FEATURE_REGISTER_PROTOCOL)
+    {
+        mutex_unlock(&reader->lock);
+        return -EOPNOTSUPP;
+    }
+
+    printk(KERN_INFO "ds310_sensor_read\n");
+
+    /* Decide amount of bytes to copy */
+    status = min(length, sizeof(reader->register_value));
+
+    /* Copy register value to user space */
+    if (copy_to_user(user_buffer, &reader->register_value, status))
+    {
+        status = -EFAULT;
+    }
+
+    mutex_unlock(&reader->lock);
+
+    return status;
+}
+
+/**
+ * @brief Receive ds310 sensor register address or value or both
+ */
+static ssize_t ds310_sensor_write(struct file *device_file, const char __user *user_buffer, size_t length, loff_t *offset)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+    struct ds310_sensor *sensor = reader->sensor;
+
+    uint8_t buffer[2] = {0};
+    int status = 0;
+
+    printk(KERN_INFO "ds310_sensor_write\n");
+
+    /* One byte selects a register, two bytes write a register */
+    if (length != 1 && length != 2)
+    {
+        printk(KERN_ERR "ds310_sensor_write: wrong length\n");
+        return -EINVAL;
+    }
+
+    /* Selecting a register to read belongs to the register protocol */
+    if (length == 1 && !DS310_FEATURE_REGISTER_PROTOCOL)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    /* Copy register address or value or both to kernel space */
+    if (copy_from_user(buffer, user_buffer, length))
+    {
+        return -EFAULT;
+    }
+
+    if (mutex_lock_interruptible(&reader->lock))
+    {
+        return -ERESTARTSYS;
+    }
+    mutex_lock(&sensor->lock);
+
+    if (sensor->gone)
+    {
+        status = -ENODEV;
+    }
+    else if (length == 1)
+    {
+        /* Read register value, a failed transfer keeps the previous one */
+        status = ds310_sensor_read_byte(sensor, buffer[0]);
+        if (status >= 0)
+        {
+            reader->register_value = status;
+        }
+    }
+    else
+    {
+        /* Write register value */
+        status = ds310_sensor_configure(sensor, buffer[0], buffer[1]);
+    }
+
+    mutex_unlock(&sensor->lock);
+    mutex_unlock(&reader->lock);
+
+    return status < 0 ? status : length;
+}
+
+/**
+ * @brief Wait for samples of a streaming reader
+ */
+static __poll_t ds310_sensor_poll(struct file *device_file, poll_table *wait)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+
+    if (reader->format == DS310_FORMAT_REGISTER)
+    {
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+    }
+
+    poll_wait(device_file, &reader->sensor->stream.wait, wait);
+
+    if (READ_ONCE(reader->sensor->gone) && !ds310_sensor_readable(reader))
+    {
+        return EPOLLHUP | EPOLLERR;
+    }
+
+    return (ds310_sensor_readable(reader) ? EPOLLIN | EPOLLRDNORM : 0) | EPOLLOUT | EPOLLWRNORM;
+}
+
+/**
+ * @brief Select the read format, query calibration, statistics and
+ *        registers or load the recording of a virtual sensor
+ */
+static long ds310_sensor_ioctl(struct file *device_file, unsigned int command, unsigned long argument)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+    struct ds310_sensor *sensor = reader->sensor;
+    struct ds310_calibration calibration = {0};
+    struct ds310_stats stats = {0};
+    struct ds310_registers registers = {0};
+    u32 format = 0;
+    int status = 0;
+
+    switch (command)
+    {
+    case DS310_IOC_SET_FORMAT:
+        if (get_user(format, (u32 __user *)argument))
+        {
+            return -EFAULT;
+        }
+        if (mutex_lock_interruptible(&reader->lock))
+        {
+            return -ERESTARTSYS;
+        }
+        status = ds310_sensor_set_format(reader, format);
+        mutex_unlock(&reader->lock);
+        return status;
+
+    case DS310_IOC_GET_CALIBRATION:
+        mutex_lock(&sensor->lock);
+        calibration.c0 = sensor->calibration.c0;
+        calibration.c1 = sensor->calibration.c1;
+        calibration.c00 = sensor->calibration.c00;
+        calibration.c10 = sensor->calibration.c10;
+        calibration.c01 = sensor->calibration.c01;
+        calibration.c11 = sensor->calibration.c11;
+        calibration.c20 = sensor->calibration.c20;
+        calibration.c21 = sensor->calibration.c21;
+        calibration.c30 = sensor->calibration.c30;
+        calibration.kp = ds310_sensor_scale_factors[sensor->prs_cfg & DS310_OVERSAMPLING_MASK];
+        calibration.kt = ds310_sensor_scale_factors[sensor->tmp_cfg & DS310_OVERSAMPLING_MASK];
+        mutex_unlock(&sensor->lock);
+        return copy_to_user((void __user *)argument, &calibration, sizeof(calibration)) ? -EFAULT : 0;
+
+    case DS310_IOC_GET_STATS:
+        if (!DS310_FEATURE_STATS)
+        {
+            return -ENOTTY;
+        }
+        ds310_sensor_get_stats(sensor, &stats);
+        stats.dropped = reader->dropped;
+        return copy_to_user((void __user *)argument, &stats, sizeof(stats)) ? -EFAULT : 0;
+
+    case DS310_IOC_GET_REGISTERS:
+        status = ds310_sensor_read_registers(sensor, &registers);
+        if (status < 0)
+        {
+            return status;
+        }
+        return copy_to_user((void __user *)argument, &registers, sizeof(registers)) ? -EFAULT : 0;
+
+    case DS310_IOC_LOAD_REPLAY:
+        return ds310_sensor_load_replay(sensor, (const struct ds310_replay __user *)argument);
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * @brief Move the stream position of a streaming reader to a sample
+ *        number, used by mapped readers to acknowledge samples, returns
+ *        the position reached, at most the head
+ */
+static loff_t ds310_sensor_llseek(struct file *device_file, loff_t offset, int whence)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+    struct ds310_sensor *sensor = reader->sensor;
+
+    if (whence != SEEK_SET && whence != SEEK_CUR)
+    {
+        return -EINVAL;
+    }
+
+    if (mutex_lock_interruptible(&reader->lock))
+    {
+        return -ERESTARTSYS;
+    }
+    if (reader->format == DS310_FORMAT_REGISTER)
+    {
+        mutex_unlock(&reader->lock);
+        return -EINVAL;
+    }
+
+    /* Mapped readers ask for their starting sample number */
+    if (whence == SEEK_CUR)
+    {
+        if (offset == 0)
+        {
+            offset = reader->tail;
+            mutex_unlock(&reader->lock);
+            return offset;
+        }
+        offset += reader->tail;
+    }
+    if (offset < 0)
+    {
+        mutex_unlock(&reader->lock);
+        return -EINVAL;
+    }
+
+    /* Samples that were not written yet cannot be acknowledged */
+    reader->tail = min_t(u64, offset, ds310_sensor_head(sensor));
+    offset = reader->tail;
+
+    /* The compressed stream restarts with a key frame */
+    reader->key_pending = true;
+    reader->pending_length = 0;
+    reader->pending_offset = 0;
+    mutex_unlock(&reader->lock);
+
+    return offset;
+}
+
+/**
+ * @brief Map the sample ring read only into the user space
+ */
+static int ds310_sensor_mmap(struct file *device_file, struct vm_area_struct *vma)
+{
+    struct ds310_sensor_reader *reader = device_file->private_data;
+
+    if (vma->vm_flags & VM_WRITE)
+    {
+        return -EPERM;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    return remap_vmalloc_range(vma, reader->sensor->stream.ring, vma->vm_pgoff);
+}
+
+/**
+ * @brief Start a measurement on every member back to back, the caller
+ *        holds the member locks
+ */
+static int ds310_sensor_sync_start(struct ds310_sensor_sync_group *group, uint8_t control)
+{
+    int status = 0;
+    u32 i = 0;
+
+    for (i = 0; i < group->count; i++)
+    {
+        status = ds310_sensor_write_byte(group->members[i], DS310_MEAS_CFG, control);
+        if (status < 0)
+        {
+            ds310_sensor_count_error(group->members[i]);
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Wait until every member reports a ready result, the caller
+ *        holds the member locks
+ */
+static int ds310_sensor_sync_wait(struct ds310_sensor_sync_group *group, uint8_t ready)
+{
+    u32 pending = BIT(group->count) - 1;
+    unsigned int attempt = 0;
+    int status = 0;
+    u32 i = 0;
+
+    for (attempt = 0; pending && attempt < DS310_GROUP_READY_ATTEMPTS; attempt++)
+    {
+        usleep_range(DS310_GROUP_READY_US, 2 * DS310_GROUP_READY_US);
+
+        for (i = 0; i < group->count; i++)
+        {
+            if (!(pending & BIT(i)))
+            {
+                continue;
+            }
+
+            status = ds310_sensor_read_byte(group->members[i], DS310_MEAS_CFG);
+            if (status < 0)
+            {
+                ds310_sensor_count_error(group->members[i]);
+                return status;
+            }
+
+            if (status & ready)
+            {
+                pending &= ~BIT(i);
+            }
+        }
+    }
+
+    for (i = 0; i < group->count; i++)
+    {
+        if (pending & BIT(i))
+        {
+            ds310_sensor_count_error(group->members[i]);
+        }
+    }
+
+    return pending ? -ETIMEDOUT : 0;
+}
+
+/**
+ * @brief Publish a combined record to the readers of a group
+ */
+static void ds310_sensor_sync_push(struct ds310_sensor_sync_group *group, const struct ds310_group_record *record)
+{
+    u64 head = atomic64_read(&group->head);
+
+    group->records[head & (DS310_GROUP_RING_SIZE - 1)] = *record;
+
+    /* Same protocol as ds310_sensor_push_samples() */
+    atomic64_set_release(&group->head, head + 1);
+    smp_wmb();
+
+    if (wq_has_sleeper(&group->wait))
+    {
+        wake_up_interruptible(&group->wait);
+    }
+}
+
+/**
+ * @brief Measure all members of a group at the same instant, the caller
+ *        holds the group lock
+ *
+ * The temperature conversions run first since the pressure is compensated
+ * with them, then the pressure conversions are started back to back. The
+ * shared timestamp is the middle of the pressure conversion starts.
+ */
+static int ds310_sensor_sync_capture(struct ds310_sensor_sync_group *group)
+{
+    struct ds310_group_record record = { .count = group->count };
+    struct ds310_group_member *member = NULL;
+    struct ds310_sensor *sensor = NULL;
+    struct ds310_sample sample = {0};
+    u64 first = 0, last = 0;
+    int status = 0;
+    u32 i = 0;
+
+    /* The group lock fixes the member order, lockdep gets one subclass per member */
+    for (i = 0; i < group->count; i++)
+    {
+        mutex_lock_nested(&group->members[i]->lock, i);
+    }
+
+    status = ds310_sensor_sync_start(group, DS310_MEAS_CTRL_TMP);
+    if (status == 0)
+    {
+        status = ds310_sensor_sync_wait(group, DS310_TMP_RDY);
+    }
+
+    if (status == 0)
+    {
+        first = ds310_sensor_timestamp(group->members[0]);
+        status = ds310_sensor_sync_start(group, DS310_MEAS_CTRL_PRS);
+        last = ds310_sensor_timestamp(group->members[0]);
+    }
+
+    if (status == 0)
+    {
+        status = ds310_sensor_sync_wait(group, DS310_PRS_RDY);
+    }
+
+    record.timestamp = first + ((last - first) >> 1);
+    record.skew = last - first;
+
+    for (i = 0; status == 0 && i < group->count; i++)
+    {
+        sensor = group->members[i];
+        member = &record.members[i];
+
+        status = ds310_sensor_read_raw(sensor, &member->pressure_raw, &member->temperature_raw);
+        if (status < 0)
+        {
+            ds310_sensor_count_error(sensor);
+            break;
+        }
+
+        member->index = sensor->index;
+        ds310_sensor_compensate(sensor, member->pressure_raw, member->temperature_raw, &member->pressure, &member->temperature);
+
+        /* Readers of the member itself get the sample in the member's clock */
+        if (atomic_read(&sensor->stream.readers) > 0)
+        {
+            sample.timestamp = record.timestamp + ds310_sensor_timestamp(sensor) - ds310_sensor_timestamp(group->members[0]);
+            sample.pressure_raw = member->pressure_raw;
+            sample.temperature_raw = member->temperature_raw;
+            sample.pressure = member->pressure;
+            sample.temperature = member->temperature;
+            sample.flags = DS310_SAMPLE_FRESH_PRESSURE | DS310_SAMPLE_FRESH_TEMPERATURE;
+            ds310_sensor_push_samples(sensor, &sample, 1);
+        }
+    }
+
+    for (i = group->count; i-- > 0;)
+    {
+        mutex_unlock(&group->members[i]->lock);
+    }
+
+    if (status == 0)
+    {
+        ds310_sensor_sync_push(group, &record);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Capture a combined record for every trigger while the group
+ *        device is open
+ */
+static int ds310_sensor_sync_thread(void *data)
+{
+    struct ds310_sensor_sync_group *group = data;
+
+    while (!kthread_should_stop())
+    {
+        wait_event_interruptible(group->trigger_wait,
+                                 atomic_read(&group->triggers) > 0 || kthread_should_stop());
+        if (kthread_should_stop())
+        {
+            break;
+        }
+
+        /* Triggers arriving during a capture are merged into the next one */
+        atomic_set(&group->triggers, 0);
+
+        mutex_lock(&group->lock);
+        if (group->count && atomic_read(&group->readers) > 0)
+        {
+            ds310_sensor_sync_capture(group);
+        }
+        mutex_unlock(&group->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Trigger a capture at trigger_rate_hz
+ */
+static enum hrtimer_restart ds310_sensor_sync_timer(struct hrtimer *timer)
+{
+    struct ds310_sensor_sync_group *group = container_of(timer, struct ds310_sensor_sync_group, timer);
+
+    atomic_inc(&group->triggers);
+    wake_up_interruptible(&group->trigger_wait);
+    hrtimer_forward_now(timer, group->period);
+
+    return HRTIMER_RESTART;
+}
+
+/**
+ * @brief Run the trigger timer while the group device is open and a
+ *        rate is set, the caller holds the group lock
+ */
+static void ds310_sensor_sync_update_timer(struct ds310_sensor_sync_group *group)
+{
+    hrtimer_cancel(&group->timer);
+
+    if (atomic_read(&group->readers) > 0 && group->rate_hz)
+    {
+        group->period = ns_to_ktime(div_u64(NSEC_PER_SEC, group->rate_hz));
+        hrtimer_start(&group->timer, group->period, HRTIMER_MODE_REL);
+    }
+}
+
+/**
+ * @brief Open a group device file, reading starts at the next record
+ */
+static int ds310_sensor_sync_open(struct inode *inode, struct file *device_file)
+{
+    struct ds310_sensor_sync_group *group = container_of(inode->i_cdev, struct ds310_sensor_sync_group, character_device);
+    struct ds310_sensor_sync_reader *reader = NULL;
+
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (reader == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    reader->group = group;
+    mutex_init(&reader->lock);
+
+    mutex_lock(&group->lock);
+    reader->tail = atomic64_read_acquire(&group->head);
+    atomic_inc(&group->readers);
+    ds310_sensor_sync_update_timer(group);
+    mutex_unlock(&group->lock);
+
+    device_file->private_data = reader;
+
+    return 0;
+}
+
+/**
+ * @brief Close a group device file, the timer stops with the last one
+ */
+static int ds310_sensor_sync_release(struct inode *inode, struct file *device_file)
+{
+    struct ds310_sensor_sync_reader *reader = device_file->private_data;
+    struct ds310_sensor_sync_group *group = reader->group;
+
+    mutex_lock(&group->lock);
+    atomic_dec(&group->readers);
+    ds310_sensor_sync_update_timer(group);
+    mutex_unlock(&group->lock);
+
+    kfree(reader);
+
+    return 0;
+}
+
+/**
+ * @brief Whether a group reader has records to read
+ */
+static bool ds310_sensor_sync_readable(struct ds310_sensor_sync_reader *reader)
+{
+    return atomic64_read_acquire(&reader->group->head) != reader->tail;
+}
+
+/**
+ * @brief Send whole combined records to the user space
+ *
+ * Records overwritten before they were copied are skipped.
+ */
+static ssize_t ds310_sensor_sync_read(struct file *device_file, char __user *user_buffer, size_t length, loff_t *offset)
+{
+    struct ds310_sensor_sync_reader *reader = device_file->private_data;
+    struct ds310_sensor_sync_group *group = reader->group;
+    struct ds310_group_record record;
+    ssize_t copied = 0;
+    u64 head = 0;
+
+    if (length < sizeof(record))
+    {
+        return -EINVAL;
+    }
+
+    if (mutex_lock_interruptible(&reader->lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    if (!ds310_sensor_sync_readable(reader))
+    {
+        if (device_file->f_flags & O_NONBLOCK)
+        {
+            mutex_unlock(&reader->lock);
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(group->wait, ds310_sensor_sync_readable(reader)))
+        {
+            mutex_unlock(&reader->lock);
+            return -ERESTARTSYS;
+        }
+    }
+
+    while (copied + sizeof(record) <= length)
+    {
+        head = atomic64_read_acquire(&group->head);
+        if (head == reader->tail)
+        {
+            break;
+        }
+
+        if (head - reader->tail > DS310_GROUP_RING_SIZE)
+        {
+            reader->tail = head - DS310_GROUP_RING_SIZE;
+        }
+
+        record = group->records[reader->tail & (DS310_GROUP_RING_SIZE - 1)];
+
+        /* The producer may have overwritten the record while it was copied */
+        smp_rmb();
+        if (atomic64_read(&group->head) - reader->tail > DS310_GROUP_RING_SIZE - 1)
+        {
+            reader->tail++;
+            continue;
+        }
+
+        if (copy_to_user(user_buffer + copied, &record, sizeof(record)))
+        {
+            mutex_unlock(&reader->lock);
+            return copied ? copied : -EFAULT;
+        }
+
+        reader->tail++;
+        copied += sizeof(record);
+    }
+
+    mutex_unlock(&reader->lock);
+
+    return copied;
+}
+
+/**
+ * @brief Trigger a capture of the group, the written data is ignored
+ */
+static ssize_t ds310_sensor_sync_write(struct file *device_file, const char __user *user_buffer, size_t length, loff_t *offset)
+{
+    struct ds310_sensor_sync_reader *reader = device_file->private_data;
+
+    atomic_inc(&reader->group->triggers);
+    wake_up_interruptible(&reader->group->trigger_wait);
+
+    return length;
+}
+
+/**
+ * @brief Wait for combined records
+ */
+static __poll_t ds310_sensor_sync_poll(struct file *device_file, poll_table *wait)
+{
+    struct ds310_sensor_sync_reader *reader = device_file->private_data;
+
+    poll_wait(device_file, &reader->group->wait, wait);
+
+    return (ds310_sensor_sync_readable(reader) ? EPOLLIN | EPOLLRDNORM : 0) | EPOLLOUT | EPOLLWRNORM;
+}
+
+static struct file_operations ds310_sensor_sync_file_operations =
+{
+    .owner = THIS_MODULE,
+    .open = ds310_sensor_sync_open,
+    .release = ds310_sensor_sync_release,
+    .read = ds310_sensor_sync_read,
+    .write = ds310_sensor_sync_write,
+    .poll = ds310_sensor_sync_poll,
+    .llseek = no_llseek,
+};
+
+/**
+ * @brief Show the trigger rate of a group, 0 when only writes trigger
+ */
+static ssize_t ds310_sensor_trigger_rate_hz_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor_sync_group *group = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(group->rate_hz));
+}
+
+/**
+ * @brief Set the trigger rate of a group, 0 to trigger only by writes
+ */
+static ssize_t ds310_sensor_trigger_rate_hz_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor_sync_group *group = dev_get_drvdata(dev);
+    u32 value = 0;
+    int status = kstrtou32(buf, 10, &value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (value > DS310_GROUP_RATE_MAX)
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&group->lock);
+    group->rate_hz = value;
+    ds310_sensor_sync_update_timer(group);
+    mutex_unlock(&group->lock);
+
+    return count;
+}
+
+/**
+ * @brief Show the sensor numbers of the members in record order
+ */
+static ssize_t ds310_sensor_members_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor_sync_group *group = dev_get_drvdata(dev);
+    ssize_t length = 0;
+    u32 i = 0;
+
+    mutex_lock(&group->lock);
+    for (i = 0; i < group->count; i++)
+    {
+        length += sysfs_emit_at(buf, length, "%s%d", i ? " " : "", group->members[i]->index);
+    }
+    mutex_unlock(&group->lock);
+
+    return length + sysfs_emit_at(buf, length, "\n");
+}
+
+static DEVICE_ATTR(trigger_rate_hz, 0644, ds310_sensor_trigger_rate_hz_show, ds310_sensor_trigger_rate_hz_store);
+static DEVICE_ATTR(members, 0444, ds310_sensor_members_show, NULL);
+
+static struct attribute *ds310_sensor_sync_device_attrs[] =
+{
+    &dev_attr_trigger_rate_hz.attr,
+    &dev_attr_members.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ds310_sensor_sync_device);
+
+/**
+ * @brief Create the device file and trigger thread of group index,
+ *        the caller holds ds310_sensor_sync_groups_lock
+ */
+static struct ds310_sensor_sync_group *ds310_sensor_sync_create(int index)
+{
+    struct ds310_sensor_sync_group *group = NULL;
+    dev_t device_number;
+
+    group = kzalloc(sizeof(*group), GFP_KERNEL);
+    if (group == NULL)
+    {
+        return NULL;
+    }
+
+    group->records = kvmalloc_array(DS310_GROUP_RING_SIZE, sizeof(*group->records), GFP_KERNEL);
+    if (group->records == NULL)
+    {
+        goto RECORDS_ERROR;
+    }
+
+    group->index = index;
+    mutex_init(&group->lock);
+    init_waitqueue_head(&group->wait);
+    init_waitqueue_head(&group->trigger_wait);
+    atomic64_set(&group->head, 0);
+    atomic_set(&group->readers, 0);
+    atomic_set(&group->triggers, 0);
+    hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    group->timer.function = ds310_sensor_sync_timer;
+
+    group->thread = kthread_run(ds310_sensor_sync_thread, group, "ds310_group%d", index);
+    if (IS_ERR(group->thread))
+    {
+        goto THREAD_ERROR;
+    }
+
+    group->minor = ida_alloc_max(&ds310_sensor_minors, DS310_MAX_SENSORS - 1, GFP_KERNEL);
+    if (group->minor < 0)
+    {
+        goto DEVICE_NUMBER_ERROR;
+    }
+    device_number = MKDEV(MAJOR(ds310_sensor_device_number), group->minor);
+
+    cdev_init(&group->character_device, &ds310_sensor_sync_file_operations);
+    if (cdev_add(&group->character_device, device_number, 1) < 0)
+    {
+        goto KERNEL_ERROR;
+    }
+
+    group->device = device_create_with_groups(ds310_sensor_class, NULL, device_number, group,
+                                              ds310_sensor_sync_device_groups, "ds310_group%d", index);
+    if (IS_ERR(group->device))
+    {
+        goto DEVICE_FILE_ERROR;
+    }
+
+    return group;
+
+DEVICE_FILE_ERROR:
+    cdev_del(&group->character_device);
+KERNEL_ERROR:
+    ida_free(&ds310_sensor_minors, group->minor);
+DEVICE_NUMBER_ERROR:
+    kthread_stop(group->thread);
+THREAD_ERROR:
+    kvfree(group->records);
+RECORDS_ERROR:
+    kfree(group);
+    return NULL;
+}
+
+/**
+ * @brief Remove a group, its members have left
+ */
+static void ds310_sensor_sync_destroy(struct ds310_sensor_sync_group *group)
+{
+    device_destroy(ds310_sensor_class, MKDEV(MAJOR(ds310_sensor_device_number), group->minor));
+    cdev_del(&group->character_device);
+    ida_free(&ds310_sensor_minors, group->minor);
+
+    hrtimer_cancel(&group->timer);
+    kthread_stop(group->thread);
+    kvfree(group->records);
+    kfree(group);
+}
+
+/**
+ * @brief Add a hardware sensor to group index, creating the group with
+ *        its first member, the caller holds ds310_sensor_sync_groups_lock
+ *
+ * The sensor leaves background mode and only measures when the group is
+ * triggered, its previous mode is restored when it leaves.
+ */
+static int ds310_sensor_sync_join(struct ds310_sensor *sensor, int index)
+{
+    struct ds310_sensor_sync_group *group = ds310_sensor_sync_groups[index - 1];
+    int status = 0;
+
+    if (group == NULL)
+    {
+        group = ds310_sensor_sync_create(index);
+        if (group == NULL)
+        {
+            return -ENOMEM;
+        }
+        ds310_sensor_sync_groups[index - 1] = group;
+    }
+
+    mutex_lock(&group->lock);
+
+    if (group->count == DS310_GROUP_MAX_MEMBERS)
+    {
+        status = -ENOSPC;
+        goto UNLOCK;
+    }
+
+    mutex_lock(&sensor->lock);
+
+    /* Group captures read the results, the FIFO stays off. The acquisition
+     * thread checks batched under the sensor lock before it drains the FIFO
+     * or enables the interrupt, and the interrupt thread does not batch a
+     * group member again. */
+    if (sensor->batched)
+    {
+        status = ds310_sensor_set_batched(sensor, false);
+        if (status == 0)
+        {
+            enable_irq(sensor->irq);
+        }
+    }
+
+    if (status >= 0)
+    {
+        status = ds310_sensor_read_byte(sensor, DS310_MEAS_CFG);
+    }
+    if (status >= 0)
+    {
+        sensor->meas_cfg = status & DS310_MEAS_CTRL_MASK;
+        status = ds310_sensor_write_byte(sensor, DS310_MEAS_CFG, 0);
+    }
+
+    if (status >= 0)
+    {
+        ds310_sensor_push_config(sensor);
+        WRITE_ONCE(sensor->sync_group, group);
+        group->members[group->count++] = sensor;
+        status = 0;
+    }
+
+    mutex_unlock(&sensor->lock);
+
+UNLOCK:
+    mutex_unlock(&group->lock);
+
+    return status;
+}
+
+/**
+ * @brief Remove a sensor from its group and restore its measurement
+ *        mode, the caller holds ds310_sensor_sync_groups_lock
+ */
+static void ds310_sensor_sync_leave(struct ds310_sensor *sensor)
+{
+    struct ds310_sensor_sync_group *group = sensor->sync_group;
+    u32 i = 0;
+
+    if (group == NULL)
+    {
+        return;
+    }
+
+    mutex_lock(&group->lock);
+
+    for (i = 0; i < group->count && group->members[i] != sensor; i++)
+    {
+    }
+    memmove(&group->members[i], &group->members[i + 1], (group->count - i - 1) * sizeof(group->members[0]));
+    group->count--;
+
+    mutex_lock(&sensor->lock);
+    if (ds310_sensor_write_byte(sensor, DS310_MEAS_CFG, sensor->meas_cfg) < 0)
+    {
+        ds310_sensor_count_error(sensor);
+    }
+    else
+    {
+        ds310_sensor_push_config(sensor);
+    }
+    WRITE_ONCE(sensor->sync_group, NULL);
+    mutex_unlock(&sensor->lock);
+
+    mutex_unlock(&group->lock);
+}
+
+/**
+ * @brief Show the group of a sensor, 0 for none
+ */
+static ssize_t ds310_sensor_sync_group_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    struct ds310_sensor_sync_group *group = READ_ONCE(sensor->sync_group);
+
+    return sysfs_emit(buf, "%d\n", group ? group->index : 0);
+}
+
+/**
+ * @brief Move a hardware sensor to a group, 0 to leave its group
+ */
+static ssize_t ds310_sensor_sync_group_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+    u32 value = 0;
+    int status = kstrtou32(buf, 10, &value);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    if (value > DS310_MAX_GROUPS || (value && sensor->client == NULL))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&ds310_sensor_sync_groups_lock);
+    if (sensor->sync_group == NULL || sensor->sync_group->index != value)
+    {
+        ds310_sensor_sync_leave(sensor);
+        if (value)
+        {
+            status = ds310_sensor_sync_join(sensor, value);
+        }
+    }
+    mutex_unlock(&ds310_sensor_sync_groups_lock);
+
+    return status < 0 ? status : count;
+}
+
+/**
+ * @brief Show how often the sensor was reset and reconfigured
+ */
+static ssize_t ds310_sensor_recoveries_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ds310_sensor *sensor = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", atomic_read(&sensor->recoveries));
+}
+
+static DEVICE_ATTR(pressure, 0444, ds310_sensor_pressure_show, NULL);
+static DEVICE_ATTR(temperature, 0444, ds310_sensor_temperature_show, NULL);
+static DEVICE_ATTR(altitude, 0444, ds310_sensor_altitude_show, NULL);
+static DEVICE_ATTR(sea_level_pressure, 0644, ds310_sensor_sea_level_pressure_show, ds310_sensor_sea_level_pressure_store);
+static DEVICE_ATTR(current_timestamp_clock, 0644, ds310_sensor_current_timestamp_clock_show, ds310_sensor_current_timestamp_clock_store);
+static DEVICE_ATTR(acquisition_mode, 0444, ds310_sensor_acquisition_mode_show, NULL);
+static DEVICE_ATTR(acquisition_cpu, 0644, ds310_sensor_acquisition_cpu_show, ds310_sensor_acquisition_cpu_store);
+static DEVICE_ATTR(acquisition_priority, 0644, ds310_sensor_acquisition_priority_show, ds310_sensor_acquisition_priority_store);
+static DEVICE_ATTR(sync_group, 0644, ds310_sensor_sync_group_show, ds310_sensor_sync_group_store);
+static DEVICE_ATTR(recoveries, 0444, ds310_sensor_recoveries_show, NULL);
+
+static struct attribute *ds310_sensor_attrs[] =
+{
+    &dev_attr_pressure.attr,
+    &dev_attr_temperature.attr,
+    &dev_attr_altitude.attr,
+    &dev_attr_sea_level_pressure.attr,
+    &dev_attr_current_timestamp_clock.attr,
+    &dev_attr_acquisition_mode.attr,
+    &dev_attr_acquisition_cpu.attr,
+    &dev_attr_acquisition_priority.attr,
+    &dev_attr_sync_group.attr,
+    &dev_attr_recoveries.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ds310_sensor);
+
+/**
+ * @brief Mapping file operations to the character device file
+ */
+static struct file_operations ds310_sensor_file_operations =
+{
+    .owner = THIS_MODULE,
+    .open = ds310_sensor_open,
+    .release = ds310_sensor_release,
+    .read = ds310_sensor_read,
+    .write = ds310_sensor_write,
+    .poll = ds310_sensor_poll,
+    .llseek = ds310_sensor_llseek,
+    .mmap = ds310_sensor_mmap,
+    .unlocked_ioctl = ds310_sensor_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+/**
+ * @brief Stream every sensor that is not streamed by an aggregate reader
+ *        yet, the caller holds ds310_sensor_table_lock
+ *
+ * Called when the aggregate reader is allocated and when a sensor is
+ * added, reads and polls never allocate.
+ */
+static void ds310_sensor_aggregate_bind(struct ds310_sensor_aggregate_reader *aggregate)
+{
+    struct ds310_sensor_reader *reader = NULL;
+    int i = 0;
+
+    for (i = 0; i < DS310_MAX_SENSORS; i++)
+    {
+        if (ds310_sensor_table[i] == NULL || aggregate->readers[i] != NULL)
+        {
+            continue;
+        }
+
+        reader = kvzalloc(sizeof(*reader), GFP_KERNEL);
+        if (reader == NULL)
+        {
+            printk(KERN_ERR "ds310_sensor_aggregate_bind: allocating a reader failed\n");
+            continue;
+        }
+
+        reader->sensor = ds310_sensor_table[i];
+        mutex_init(&reader->lock);
+        reader->format = DS310_FORMAT_REGISTER;
+        ds310_sensor_set_format(reader, DS310_FORMAT_RECORD);
+
+        aggregate->readers[i] = reader;
+        aggregate->staged[i] = 0;
+        aggregate->position[i] = 0;
+    }
+}
+
+/**
+ * @brief Stop streaming a sensor for an aggregate reader, the caller
+ *        holds ds310_sensor_table_lock
+ */
+static void ds310_sensor_aggregate_unbind(struct ds310_sensor_aggregate_reader *aggregate, int minor)
+{
+    if (aggregate->readers[minor] != NULL)
+    {
+        ds310_sensor_set_format(aggregate->readers[minor], DS310_FORMAT_REGISTER);
+        kvfree(aggregate->readers[minor]);
+        aggregate->readers[minor] = NULL;
+    }
+}
+
+/**
+ * @brief Merge the buffered samples of all sensors in timestamp order,
+ *        the caller holds ds310_sensor_table_lock
+ *
+ * Samples of one sensor are fetched in batches and staged until they
+ * are merged, so a sample is only emitted after the earlier samples
+ * every sensor had buffered at that time.
+ */
+static size_t ds310_sensor_aggregate_merge(struct ds310_sensor_aggregate_reader *aggregate, size_t count)
+{
+    struct ds310_sensor_reader *reader = NULL;
+    size_t copied = 0;
+    int i = 0, next = 0;
+
+    for (copied = 0; copied < count; copied++)
+    {
+        next = -1;
+
+        for (i = 0; i < DS310_MAX_SENSORS; i++)
+        {
+            reader = aggregate->readers[i];
+            if (reader == NULL)
+            {
+                continue;
+            }
+
+            if (aggregate->position[i] == aggregate->staged[i])
+            {
+                aggregate->staged[i] = ds310_sensor_fetch_samples(reader, reader->batch, DS310_READ_BATCH);
+                aggregate->position[i] = 0;
+            }
+
+            if (aggregate->position[i] < aggregate->staged[i] &&
+                (next < 0 || reader->batch[aggregate->position[i]].timestamp <
+                             aggregate->readers[next]->batch[aggregate->position[next]].timestamp))
+            {
+                next = i;
+            }
+        }
+
+        if (next < 0)
+        {
+            break;
+        }
+
+        aggregate->batch[copied].minor = next;
+        aggregate->batch[copied].reserved = 0;
+        aggregate->batch[copied].sample = aggregate->readers[next]->batch[aggregate->position[next]++];
+    }
+
+    return copied;
+}
+
+/**
+ * @brief Allocate an aggregate reader that streams every sensor
+ */
+static struct ds310_sensor_aggregate_reader *ds310_sensor_aggregate_alloc(void)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = NULL;
+
+    aggregate = kvzalloc(sizeof(*aggregate), GFP_KERNEL);
+    if (aggregate == NULL)
+    {
+        return NULL;
+    }
+
+    mutex_init(&aggregate->lock);
+
+    mutex_lock(&ds310_sensor_table_lock);
+    atomic_inc(&ds310_sensor_aggregate_readers);
+    list_add_tail(&aggregate->node, &ds310_sensor_aggregates);
+    ds310_sensor_aggregate_bind(aggregate);
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    return aggregate;
+}
+
+/**
+ * @brief Stop streaming the sensors of an aggregate reader and free it
+ */
+static void ds310_sensor_aggregate_free(struct ds310_sensor_aggregate_reader *aggregate)
+{
+    int i = 0;
+
+    mutex_lock(&ds310_sensor_table_lock);
+    for (i = 0; i < DS310_MAX_SENSORS; i++)
+    {
+        ds310_sensor_aggregate_unbind(aggregate, i);
+    }
+    list_del(&aggregate->node);
+    atomic_dec(&ds310_sensor_aggregate_readers);
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    kvfree(aggregate);
+}
+
+/**
+ * @brief Open ds310_all, every sensor streams while it is open
+ */
+static int ds310_sensor_aggregate_open(struct inode *inode, struct file *device_file)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = ds310_sensor_aggregate_alloc();
+
+    if (aggregate == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    device_file->private_data = aggregate;
+
+    return 0;
+}
+
+/**
+ * @brief Close ds310_all and stop streaming its sensors
+ */
+static int ds310_sensor_aggregate_release(struct inode *inode, struct file *device_file)
+{
+    ds310_sensor_aggregate_free(device_file->private_data);
+
+    return 0;
+}
+
+/**
+ * @brief Send merged struct ds310_tagged_sample records to the user space
+ */
+static ssize_t ds310_sensor_aggregate_read(struct file *device_file, char __user *user_buffer, size_t length, loff_t *offset)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = device_file->private_data;
+    size_t count = min_t(size_t, DS310_READ_BATCH, length / sizeof(struct ds310_tagged_sample));
+    long generation = 0;
+    ssize_t status = 0;
+
+    if (count == 0)
+    {
+        return -EINVAL;
+    }
+
+    /* The batch belongs to the file, the table lock is not held while copying */
+    if (mutex_lock_interruptible(&aggregate->lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    while (1)
+    {
+        /* Taken before merging so no sample pushed meanwhile is missed */
+        generation = atomic_long_read(&ds310_sensor_aggregate_generation);
+
+        mutex_lock(&ds310_sensor_table_lock);
+        status = ds310_sensor_aggregate_merge(aggregate, count);
+        mutex_unlock(&ds310_sensor_table_lock);
+        if (status > 0)
+        {
+            break;
+        }
+
+        if (device_file->f_flags & O_NONBLOCK)
+        {
+            status = -EAGAIN;
+            goto UNLOCK;
+        }
+
+        if (wait_event_interruptible(ds310_sensor_aggregate_wait,
+                                     atomic_long_read(&ds310_sensor_aggregate_generation) != generation))
+        {
+            status = -ERESTARTSYS;
+            goto UNLOCK;
+        }
+    }
+
+    status *= sizeof(struct ds310_tagged_sample);
+    if (copy_to_user(user_buffer, aggregate->batch, status))
+    {
+        status = -EFAULT;
+    }
+
+UNLOCK:
+    mutex_unlock(&aggregate->lock);
+
+    return status;
+}
+
+/**
+ * @brief Wait for samples of any sensor
+ */
+static __poll_t ds310_sensor_aggregate_poll(struct file *device_file, poll_table *wait)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = device_file->private_data;
+    __poll_t events = 0;
+    int i = 0;
+
+    poll_wait(device_file, &ds310_sensor_aggregate_wait, wait);
+
+    mutex_lock(&ds310_sensor_table_lock);
+    for (i = 0; i < DS310_MAX_SENSORS && !events; i++)
+    {
+        if (aggregate->readers[i] != NULL &&
+            (aggregate->position[i] != aggregate->staged[i] || ds310_sensor_readable(aggregate->readers[i])))
+        {
+            events = EPOLLIN | EPOLLRDNORM;
+        }
+    }
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    return events;
+}
+
+static struct file_operations ds310_sensor_aggregate_file_operations =
+{
+    .owner = THIS_MODULE,
+    .open = ds310_sensor_aggregate_open,
+    .release = ds310_sensor_aggregate_release,
+    .read = ds310_sensor_aggregate_read,
+    .poll = ds310_sensor_aggregate_poll,
+    .llseek = no_llseek,
+};
+
+/**
+ * @brief Make a created sensor visible to ds310_all
+ */
+static void ds310_sensor_aggregate_add(struct ds310_sensor *sensor)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = NULL;
+
+    /* Open ds310_all files start streaming it right away */
+    mutex_lock(&ds310_sensor_table_lock);
+    ds310_sensor_table[sensor->minor] = sensor;
+    list_for_each_entry(aggregate, &ds310_sensor_aggregates, node)
+    {
+        ds310_sensor_aggregate_bind(aggregate);
+    }
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    atomic_long_inc(&ds310_sensor_aggregate_generation);
+    wake_up_interruptible(&ds310_sensor_aggregate_wait);
+}
+
+/**
+ * @brief Detach a sensor from ds310_all before it is destroyed
+ */
+static void ds310_sensor_aggregate_remove(struct ds310_sensor *sensor)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = NULL;
+
+    mutex_lock(&ds310_sensor_table_lock);
+    ds310_sensor_table[sensor->minor] = NULL;
+    list_for_each_entry(aggregate, &ds310_sensor_aggregates, node)
+    {
+        ds310_sensor_aggregate_unbind(aggregate, sensor->minor);
+    }
+    mutex_unlock(&ds310_sensor_table_lock);
+}
+
+/**
+ * @brief Create the ds310_all device file
+ */
+static int ds310_sensor_aggregate_create(void)
+{
+    struct device *device = NULL;
+    dev_t device_number;
+
+    ds310_sensor_aggregate_minor = ida_alloc_max(&ds310_sensor_minors, DS310_MAX_SENSORS - 1, GFP_KERNEL);
+    if (ds310_sensor_aggregate_minor < 0)
+    {
+        return ds310_sensor_aggregate_minor;
+    }
+    device_number = MKDEV(MAJOR(ds310_sensor_device_number), ds310_sensor_aggregate_minor);
+
+    cdev_init(&ds310_sensor_aggregate_device, &ds310_sensor_aggregate_file_operations);
+    if (cdev_add(&ds310_sensor_aggregate_device, device_number, 1) < 0)
+    {
+        goto KERNEL_ERROR;
+    }
+
+    device = device_create(ds310_sensor_class, NULL, device_number, NULL, DS310_AGGREGATE_NAME);
+    if (IS_ERR(device))
+    {
+        goto DEVICE_FILE_ERROR;
+    }
+
+    return 0;
+
+DEVICE_FILE_ERROR:
+    cdev_del(&ds310_sensor_aggregate_device);
+KERNEL_ERROR:
+    ida_free(&ds310_sensor_minors, ds310_sensor_aggregate_minor);
+    return -1;
+}
+
+/**
+ * @brief Remove the ds310_all device file
+ */
+static void ds310_sensor_aggregate_destroy(void)
+{
+    device_destroy(ds310_sensor_class, MKDEV(MAJOR(ds310_sensor_device_number), ds310_sensor_aggregate_minor));
+    cdev_del(&ds310_sensor_aggregate_device);
+    ida_free(&ds310_sensor_minors, ds310_sensor_aggregate_minor);
+}
+
+/**
+ * Generic netlink family
+ *
+ * A publisher thread, an aggregate reader like ds310_all, sends the
+ * samples of each sensor every netlink_interval_ms in one multicast
+ * message per batch, so the records are copied once for any number of
+ * listeners. It streams while the samples group has listeners and asks
+ * the netlink layer for them. Subscriptions wake it up, but netlink calls
+ * mcast_bind before it marks the socket as listener, so an idle publisher
+ * also checks again every netlink_interval_ms.
+ */
+static struct task_struct *ds310_sensor_netlink_task;
+
+static struct genl_family ds310_sensor_netlink_family;
+
+/**
+ * @brief Multicast a batch of samples of one sensor
+ */
+static void ds310_sensor_netlink_publish(int minor, const struct ds310_sample *samples, size_t count)
+{
+    size_t length = count * sizeof(*samples);
+    struct sk_buff *message = NULL;
+    void *header = NULL;
+
+    message = genlmsg_new(nla_total_size(sizeof(u32)) + nla_total_size(length), GFP_KERNEL);
+    if (message == NULL)
+    {
+        return;
+    }
+
+    header = genlmsg_put(message, 0, 0, &ds310_sensor_netlink_family, 0, DS310_CMD_SAMPLES);
+    if (header == NULL || nla_put_u32(message, DS310_ATTR_MINOR, minor) || nla_put(message, DS310_ATTR_SAMPLES, length, samples))
+    {
+        nlmsg_free(message);
+        return;
+    }
+    genlmsg_end(message, header);
+
+    /* Fails with ESRCH when the last listener just left */
+    genlmsg_multicast(&ds310_sensor_netlink_family, message, 0, 0, GFP_KERNEL);
+}
+
+/**
+ * @brief Check if the samples group has listeners
+ */
+static bool ds310_sensor_netlink_listening(void)
+{
+    return genl_has_listeners(&ds310_sensor_netlink_family, &init_net, 0);
+}
+
+/**
+ * @brief Publish the samples of all sensors while the group has
+ *        listeners
+ */
+static int ds310_sensor_netlink_thread(void *data)
+{
+    struct ds310_sensor_aggregate_reader *aggregate = NULL;
+    struct ds310_sensor_reader *reader = NULL;
+    unsigned long interval = max(netlink_interval_ms, 1U) * USEC_PER_MSEC;
+    long generation = 0;
+    size_t count = 0;
+    int i = 0;
+
+    while (!kthread_should_stop())
+    {
+        /* The sensors stop streaming with the last listener */
+        if (!ds310_sensor_netlink_listening())
+        {
+            if (aggregate != NULL)
+            {
+                ds310_sensor_aggregate_free(aggregate);
+                aggregate = NULL;
+            }
+
+            wait_event_interruptible_timeout(ds310_sensor_aggregate_wait,
+                                             ds310_sensor_netlink_listening() || kthread_should_stop(),
+                                             msecs_to_jiffies(max(netlink_interval_ms, 1U)));
+            continue;
+        }
+
+        if (aggregate == NULL)
+        {
+            aggregate = ds310_sensor_aggregate_alloc();
+            if (aggregate == NULL)
+            {
+                printk(KERN_ERR "ds310_sensor_netlink_thread: allocating the aggregate reader failed\n");
+                usleep_range(interval, interval + interval / 8);
+                continue;
+            }
+        }
+
+        /* Taken before fetching so no sample pushed meanwhile is missed */
+        generation = atomic_long_read(&ds310_sensor_aggregate_generation);
+
+        mutex_lock(&ds310_sensor_table_lock);
+        for (i = 0; i < DS310_MAX_SENSORS; i++)
+        {
+            reader = aggregate->readers[i];
+            if (reader == NULL)
+            {
+                continue;
+            }
+
+            do
+            {
+                count = ds310_sensor_fetch_samples(reader, reader->batch, DS310_READ_BATCH);
+                if (count)
+                {
+                    ds310_sensor_netlink_publish(i, reader->batch, count);
+                }
+            } while (count == DS310_READ_BATCH);
+        }
+        mutex_unlock(&ds310_sensor_table_lock);
+
+        /* Samples of the next interval go out together */
+        wait_event_interruptible(ds310_sensor_aggregate_wait,
+                                 atomic_long_read(&ds310_sensor_aggregate_generation) != generation ||
+                                 !ds310_sensor_netlink_listening() || kthread_should_stop());
+        usleep_range(interval, interval + interval / 8);
+    }
+
+    if (aggregate != NULL)
+    {
+        ds310_sensor_aggregate_free(aggregate);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Wake up the publisher when a listener joins the samples group,
+ *        it checks the listeners itself
+ */
+static int ds310_sensor_netlink_bind(struct net *net, int group)
+{
+    wake_up_interruptible(&ds310_sensor_aggregate_wait);
+
+    return 0;
+}
+
+/**
+ * @brief Wake up the publisher when a listener leaves the samples group
+ */
+static void ds310_sensor_netlink_unbind(struct net *net, int group)
+{
+    wake_up_interruptible(&ds310_sensor_aggregate_wait);
+}
+
+/**
+ * @brief Reply with the configuration of a sensor
+ */
+static int ds310_sensor_netlink_get_config(struct sk_buff *request, struct genl_info *info)
+{
+    struct ds310_config_marker config = {0};
+    struct ds310_sensor *sensor = NULL;
+    struct sk_buff *message = NULL;
+    void *header = NULL;
+    u32 minor = 0;
+
+    if (info->attrs[DS310_ATTR_MINOR] == NULL)
+    {
+        return -EINVAL;
+    }
+
+    minor = nla_get_u32(info->attrs[DS310_ATTR_MINOR]);
+    if (minor >= DS310_MAX_SENSORS)
+    {
+        return -ENODEV;
+    }
+
+    mutex_lock(&ds310_sensor_table_lock);
+    sensor = ds310_sensor_table[minor];
+    if (sensor != NULL)
+    {
+        mutex_lock(&sensor->lock);
+        ds310_sensor_get_config(sensor, &config);
+        mutex_unlock(&sensor->lock);
+    }
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    if (sensor == NULL)
+    {
+        return -ENODEV;
+    }
+
+    message = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+    if (message == NULL)
+    {
+        return -ENOMEM;
+    }
 
-static struct i2c_client *ds310_sensor_client;
+    header = genlmsg_put_reply(message, info, &ds310_sensor_netlink_family, 0, DS310_CMD_GET_CONFIG);
+    if (header == NULL ||
+        nla_put_u32(message, DS310_ATTR_MINOR, minor) ||
+        nla_put_u8(message, DS310_ATTR_PRS_CFG, config.prs_cfg) ||
+        nla_put_u8(message, DS310_ATTR_TMP_CFG, config.tmp_cfg) ||
+        nla_put_u8(message, DS310_ATTR_MEAS_CFG, config.meas_cfg) ||
+        nla_put_u8(message, DS310_ATTR_CFG_REG, config.cfg_reg) ||
+        nla_put_s32(message, DS310_ATTR_KP, config.kp) ||
+        nla_put_s32(message, DS310_ATTR_KT, config.kt))
+    {
+        nlmsg_free(message);
+        return -EMSGSIZE;
+    }
+    genlmsg_end(message, header);
+
+    return genlmsg_reply(message, info);
+}
 
 /**
- * Variables for Character Device file
+ * @brief Write the configuration attributes of a request to a sensor
+ *
+ * The measurement mode is written last, so a background measurement
+ * starts with the new oversampling rates in place.
  */
-static dev_t ds310_sensor_device_number;
-static struct class *ds310_sensor_class;
-static struct cdev ds310_sensor_character_device;
-static uint8_t register_value = 0x00;
+static int ds310_sensor_netlink_set_config(struct sk_buff *request, struct genl_info *info)
+{
+    static const struct
+    {
+        int attribute;
+        uint8_t address;
+    } registers[] =
+    {
+        { DS310_ATTR_CFG_REG, DS310_CFG_REG },
+        { DS310_ATTR_PRS_CFG, DS310_PRS_CFG },
+        { DS310_ATTR_TMP_CFG, DS310_TMP_CFG },
+        { DS310_ATTR_MEAS_CFG, DS310_MEAS_CFG },
+    };
+    struct ds310_sensor *sensor = NULL;
+    int status = 0;
+    size_t i = 0;
+    u32 minor = 0;
 
-static struct of_device_id ds310_sensor_of_match[] = {
-    { .compatible = DRIVER_COMPATIBILITY, },
-    { },
+    if (info->attrs[DS310_ATTR_MINOR] == NULL)
+    {
+        return -EINVAL;
+    }
+
+    minor = nla_get_u32(info->attrs[DS310_ATTR_MINOR]);
+    if (minor >= DS310_MAX_SENSORS)
+    {
+        return -ENODEV;
+    }
+
+    mutex_lock(&ds310_sensor_table_lock);
+    sensor = ds310_sensor_table[minor];
+    if (sensor == NULL)
+    {
+        mutex_unlock(&ds310_sensor_table_lock);
+        return -ENODEV;
+    }
+
+    mutex_lock(&sensor->lock);
+    for (i = 0; i < ARRAY_SIZE(registers) && status >= 0; i++)
+    {
+        if (info->attrs[registers[i].attribute] != NULL)
+        {
+            status = ds310_sensor_configure(sensor, registers[i].address, nla_get_u8(info->attrs[registers[i].attribute]));
+        }
+    }
+    mutex_unlock(&sensor->lock);
+    mutex_unlock(&ds310_sensor_table_lock);
+
+    return status < 0 ? status : 0;
+}
+
+static const struct nla_policy ds310_sensor_netlink_policy[DS310_ATTR_MAX + 1] =
+{
+    [DS310_ATTR_MINOR] = { .type = NLA_U32 },
+    [DS310_ATTR_SAMPLES] = { .type = NLA_BINARY },
+    [DS310_ATTR_PRS_CFG] = { .type = NLA_U8 },
+    [DS310_ATTR_TMP_CFG] = { .type = NLA_U8 },
+    [DS310_ATTR_MEAS_CFG] = { .type = NLA_U8 },
+    [DS310_ATTR_CFG_REG] = { .type = NLA_U8 },
+    [DS310_ATTR_KP] = { .type = NLA_S32 },
+    [DS310_ATTR_KT] = { .type = NLA_S32 },
 };
-MODULE_DEVICE_TABLE(of, ds310_sensor_of_match);
 
-static struct i2c_device_id ds310_sensor_id[] = {
-    { DRIVER_NAME, 0 },
-    { },
+static const struct genl_small_ops ds310_sensor_netlink_ops[] =
+{
+    {
+        .cmd = DS310_CMD_GET_CONFIG,
+        .doit = ds310_sensor_netlink_get_config,
+    },
+    {
+        .cmd = DS310_CMD_SET_CONFIG,
+        .flags = GENL_ADMIN_PERM,
+        .doit = ds310_sensor_netlink_set_config,
+    },
+};
+
+static const struct genl_multicast_group ds310_sensor_netlink_groups[] =
+{
+    { .name = DS310_GENL_GROUP_SAMPLES },
+};
+
+static struct genl_family ds310_sensor_netlink_family =
+{
+    .name = DS310_GENL_NAME,
+    .version = DS310_GENL_VERSION,
+    .maxattr = DS310_ATTR_MAX,
+    .policy = ds310_sensor_netlink_policy,
+    .module = THIS_MODULE,
+    .small_ops = ds310_sensor_netlink_ops,
+    .n_small_ops = ARRAY_SIZE(ds310_sensor_netlink_ops),
+    .mcgrps = ds310_sensor_netlink_groups,
+    .n_mcgrps = ARRAY_SIZE(ds310_sensor_netlink_groups),
+    .mcast_bind = ds310_sensor_netlink_bind,
+    .mcast_unbind = ds310_sensor_netlink_unbind,
 };
-MODULE_DEVICE_TABLE(i2c, ds310_sensor_id);
 
 /**
- * @brief This function is called, when the ds310 sensor device
- *       file is opened
+ * @brief Register the generic netlink family and start the publisher
  */
-static int ds310_sensor_open(struct inode *inode, struct file *device_file)
+static int ds310_sensor_netlink_create(void)
 {
-    printk(KERN_INFO "ds310_sensor_open\n");
+    int status = genl_register_family(&ds310_sensor_netlink_family);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    ds310_sensor_netlink_task = kthread_run(ds310_sensor_netlink_thread, NULL, "ds310_netlink");
+    if (IS_ERR(ds310_sensor_netlink_task))
+    {
+        genl_unregister_family(&ds310_sensor_netlink_family);
+        return PTR_ERR(ds310_sensor_netlink_task);
+    }
+
     return 0;
 }
 
 /**
- * @brief This function is called, when the ds310 sensor device
- *       file is closed
+ * @brief Stop publishing and unregister the generic netlink family
  */
-static int ds310_sensor_release(struct inode *inode, struct file *device_file)
+static void ds310_sensor_netlink_destroy(void)
 {
-    printk(KERN_INFO "ds310_sensor_release\n");
-    return 0;
+    /* The publisher uses the family until it stopped */
+    kthread_stop(ds310_sensor_netlink_task);
+    genl_unregister_family(&ds310_sensor_netlink_family);
 }
 
 /**
- * @brief Send ds310 sensor register value to the user space
+ * @brief Stop the acquisition of a sensor
  */
-static ssize_t ds310_sensor_read(struct file *device_file, char __user *user_buffer, size_t length, loff_t *offset)
+static void ds310_sensor_stop(struct ds310_sensor *sensor)
 {
-    printk(KERN_INFO "ds310_sensor_read\n");
-
-    uint8_t to_copy = 0, not_copied = 0, delta = 0;
-
-    /* Decide amount of bytes to copy */
-    to_copy = min(length, sizeof(register_value));
-
-    /* Copy register value to user space */
-    not_copied = copy_to_user(user_buffer, &register_value, to_copy);
+    /* The thread may enable the interrupt, it stops first */
+    if (sensor->bus)
+    {
+        ds310_sensor_leave_bus(sensor);
+    }
+    else
+    {
+        kthread_stop(sensor->stream.thread);
+    }
 
-    /* Calculate delta */
-    delta = to_copy - not_copied;
+    if (sensor->irq > 0)
+    {
+        free_irq(sensor->irq, sensor);
+    }
 
-    return delta;
+    cancel_delayed_work_sync(&sensor->recovery);
 }
 
 /**
- * @brief Receive ds310 sensor register address or value or both
+ * @brief Create the device file of a sensor and start its acquisition,
+ *        on failure the caller drops the reference of the sensor
  */
-static ssize_t ds310_sensor_write(struct file *device_file, const char __user *user_buffer, size_t length, loff_t *offset)
+static int ds310_sensor_create(struct ds310_sensor *sensor, int (*acquisition)(void *data), const char *name)
 {
-    printk(KERN_INFO "ds310_sensor_write\n");
+    dev_t device_number;
+    size_t length;
 
-    uint8_t to_copy = 0, not_copied = 0, delta = 0;
-    uint8_t buffer[2] = {0};
+    sensor->sea_level_pressure = DS310_SEA_LEVEL_PRESSURE;
+    sensor->timestamp_clock = CLOCK_MONOTONIC;
+    mutex_init(&sensor->lock);
+    kref_init(&sensor->refcount);
 
-    /* Decide amount of bytes to copy */
-    to_copy = min(length, sizeof(buffer));
+    /**
+     * Start sample acquisition, idle until a reader streams
+     */
+    length = PAGE_ALIGN(PAGE_SIZE + (size_t)ring_size * sizeof(struct ds310_sample));
+    sensor->stream.ring = vmalloc_user(length);
+    if (sensor->stream.ring == NULL)
+    {
+        printk(KERN_ERR "ds310_sensor_create: allocating the ring failed\n");
+        return -ENOMEM;
+    }
+    sensor->stream.size = ring_size;
+    sensor->stream.ring->size = ring_size;
+    sensor->stream.ring->record_size = sizeof(struct ds310_sample);
+    sensor->stream.ring->data_offset = PAGE_SIZE;
+    sensor->stream.ring->length = length;
+    sensor->stream.samples = (void *)sensor->stream.ring + PAGE_SIZE;
 
-    /* Copy register address or value or both to kernel space */
-    not_copied = copy_from_user(buffer, user_buffer, to_copy);
+    atomic64_set(&sensor->stream.head, 0);
+    atomic64_set(&sensor->stream.overruns, 0);
+    atomic64_set(&sensor->stream.errors, 0);
+    init_waitqueue_head(&sensor->stream.wait);
+    init_waitqueue_head(&sensor->stream.acquisition_wait);
+    atomic_set(&sensor->stream.readers, 0);
+    INIT_DELAYED_WORK(&sensor->recovery, ds310_sensor_recover);
 
-    if(length == 1)
+    /* A data ready interrupt replaces polling, polling remains the fallback */
+    if (sensor->irq > 0)
     {
-        /* Read register value */
-        register_value = i2c_smbus_read_byte_data(ds310_sensor_client, buffer[0]);
+        /* Batched reads drain up to the whole FIFO at once */
+        sensor->fifo_samples = kmalloc_array(DS310_FIFO_LENGTH, sizeof(*sensor->fifo_samples), GFP_KERNEL);
+        if (sensor->fifo_samples == NULL)
+        {
+            printk(KERN_ERR "ds310_sensor_create: allocating the FIFO buffer failed\n");
+            return -ENOMEM;
+        }
+
+        if (request_threaded_irq(sensor->irq, ds310_sensor_irq_handler, ds310_sensor_irq_thread,
+                                 IRQF_ONESHOT, name, sensor) < 0)
+        {
+            printk(KERN_ERR "ds310_sensor_create: request_threaded_irq failed, polling instead\n");
+            sensor->irq = 0;
+        }
     }
-    else if(length == 2)
+
+    /* Interrupt threads default to SCHED_FIFO 50, polling threads to SCHED_NORMAL */
+    sensor->acquisition_cpu = acquisition_cpu;
+    sensor->acquisition_priority = acquisition_priority >= 0 ? acquisition_priority : (sensor->irq > 0 ? MAX_RT_PRIO / 2 : 0);
+
+    /* Polled hardware sensors share the thread of their adapter, interrupt
+     * sensors keep a thread for batched reads at high rates */
+    if (sensor->client != NULL && sensor->irq <= 0)
     {
-        /* Write register value */
-        i2c_smbus_write_byte_data(ds310_sensor_client, buffer[0], buffer[1]);
+        if (ds310_sensor_join_bus(sensor, name) < 0)
+        {
+            printk(KERN_ERR "ds310_sensor_create: starting the bus thread failed\n");
+            goto THREAD_ERROR;
+        }
     }
     else
     {
-        printk(KERN_ERR "ds310_sensor_write: wrong length\n");
+        sensor->stream.thread = kthread_run(acquisition, sensor, "%s", name);
+        if (IS_ERR(sensor->stream.thread))
+        {
+            printk(KERN_ERR "ds310_sensor_create: kthread_run failed\n");
+            if (sensor->irq > 0)
+            {
+                free_irq(sensor->irq, sensor);
+            }
+            goto THREAD_ERROR;
+        }
+    }
+
+    if ((acquisition_cpu >= 0 || acquisition_priority >= 0 || sensor->irq > 0) && ds310_sensor_apply_placement(sensor) < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_create: applying CPU and priority failed\n");
+    }
+
+    /**
+     * Creating device file for ds310 sensor
+     */
+    /* Allocate Device Number */
+    sensor->minor = ida_alloc_max(&ds310_sensor_minors, DS310_MAX_SENSORS - 1, GFP_KERNEL);
+    if (sensor->minor < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_create: no free minor number\n");
+        goto DEVICE_NUMBER_ERROR;
+    }
+    device_number = MKDEV(MAJOR(ds310_sensor_device_number), sensor->minor);
+
+    /* Initialize Character Device file, it outlives the sensor while files are open */
+    sensor->character_device = cdev_alloc();
+    if (sensor->character_device == NULL)
+    {
+        printk(KERN_ERR "ds310_sensor_create: cdev_alloc failed\n");
+        goto KERNEL_ERROR;
+    }
+    sensor->character_device->ops = &ds310_sensor_file_operations;
+    sensor->character_device->owner = THIS_MODULE;
+
+    /* Opening looks the sensor up by its minor number */
+    ds310_sensor_aggregate_add(sensor);
+
+    /* Add Character Device file to the system */
+    if (cdev_add(sensor->character_device, device_number, 1) < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_create: cdev_add failed\n");
+        kobject_put(&sensor->character_device->kobj);
+        goto CDEV_ERROR;
+    }
+
+    /* Create Character Device file */
+    sensor->device = device_create_with_groups(ds310_sensor_class, NULL, device_number, sensor, ds310_sensor_groups, "%s", name);
+    if (IS_ERR(sensor->device))
+    {
+        printk(KERN_ERR "ds310_sensor_create: device_create failed\n");
+        goto DEVICE_FILE_ERROR;
+    }
+
+    /* Health tooling reads the temperature through hwmon, the sensor works without it */
+    sensor->hwmon = hwmon_device_register_with_info(sensor->device, "ds310", sensor, &ds310_sensor_hwmon_chip_info, NULL);
+    if (IS_ERR(sensor->hwmon))
+    {
+        printk(KERN_ERR "ds310_sensor_create: hwmon registration failed\n");
+        sensor->hwmon = NULL;
     }
 
-    /* Calculate delta */
-    delta = to_copy - not_copied;
+    return 0;
 
-    return delta;
+DEVICE_FILE_ERROR:
+    cdev_del(sensor->character_device);
+CDEV_ERROR:
+    ds310_sensor_aggregate_remove(sensor);
+KERNEL_ERROR:
+    ida_free(&ds310_sensor_minors, sensor->minor);
+DEVICE_NUMBER_ERROR:
+    mutex_lock(&sensor->lock);
+    sensor->gone = true;
+    mutex_unlock(&sensor->lock);
+    ds310_sensor_stop(sensor);
+THREAD_ERROR:
+    return -1;
 }
 
 /**
- * @brief Mapping file operations to the character device file
+ * @brief Remove the device file of a sensor and stop its acquisition
  */
-static struct file_operations ds310_sensor_file_operations =
+static void ds310_sensor_destroy(struct ds310_sensor *sensor)
 {
-    .owner = THIS_MODULE,
-    .open = ds310_sensor_open,
-    .release = ds310_sensor_release,
-    .read = ds310_sensor_read,
-    .write = ds310_sensor_write,
-};
+    ds310_sensor_aggregate_remove(sensor);
+
+    mutex_lock(&ds310_sensor_sync_groups_lock);
+    ds310_sensor_sync_leave(sensor);
+    mutex_unlock(&ds310_sensor_sync_groups_lock);
+
+    if (sensor->hwmon != NULL)
+    {
+        hwmon_device_unregister(sensor->hwmon);
+    }
+
+    device_destroy(ds310_sensor_class, MKDEV(MAJOR(ds310_sensor_device_number), sensor->minor));
+    cdev_del(sensor->character_device);
+    ida_free(&ds310_sensor_minors, sensor->minor);
+
+    /* Open files see the removal, nothing starts the acquisition again */
+    mutex_lock(&sensor->lock);
+    sensor->gone = true;
+    mutex_unlock(&sensor->lock);
+
+    ds310_sensor_stop(sensor);
+    wake_up_interruptible(&sensor->stream.wait);
+}
 
 /**
  * @brief This function is called during loading the driver
  */
 static int ds310_sensor_probe(struct i2c_client *client, const struct i2c_device_id *id)
 {
+    struct ds310_sensor *sensor = NULL;
+    unsigned int address = 0;
+    char name[32];
+    int status = 0;
+
     printk(KERN_INFO "ds310_sensor_probe\n");
 
     /**
      * Check if the device is ds310 pressure and temperature sensor
     */
-    if ((client->addr != DS310_SENSOR_ADDRESS) || (id->name != DRIVER_NAME))
+    if ((client->addr != DS310_SENSOR_ADDRESS && client->addr != DS310_SENSOR_ADDRESS_ALTERNATIVE) || (id->name != DRIVER_NAME))
     {
         printk(KERN_ERR "ds310_sensor_probe: wrong device %s of address 0x%x\n", id->name, client->addr);
         return -ENODEV;
     }
 
-    ds310_sensor_client = client;
+    /* Open files keep the sensor after the client is unbound, devm would free it */
+    sensor = kzalloc(sizeof(*sensor), GFP_KERNEL);
+    if (sensor == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    sensor->client = client;
+    i2c_set_clientdata(client, sensor);
 
     /**
-     * Creating device file for ds310 sensor
+     * Read calibration and configuration for compensation
      */
-    /* Allocate Device Number */
-    if (alloc_chrdev_region(&ds310_sensor_device_number, 0, 1, DRIVER_NAME) < 0)
+    if (ds310_sensor_read_calibration(sensor) < 0)
     {
-        printk(KERN_ERR "ds310_sensor_probe: alloc_chrdev_region failed\n");
-        goto DEVICE_NUMBER_ERROR;
+        printk(KERN_ERR "ds310_sensor_probe: reading calibration failed\n");
+        status = -EIO;
+        goto CALIBRATION_ERROR;
     }
 
-    /* Create Device Class */
-    if ((ds310_sensor_class = class_create(THIS_MODULE, DRIVER_CLASS)) == NULL)
+    sensor->prs_cfg = ds310_sensor_read_byte(sensor, DS310_PRS_CFG);
+    sensor->tmp_cfg = ds310_sensor_read_byte(sensor, DS310_TMP_CFG);
+
+    /* The configuration found at probe is restored after a reset as well */
+    for (address = DS310_PRS_CFG; address <= DS310_CFG_REG; address++)
     {
-        printk(KERN_ERR "ds310_sensor_probe: class_create failed\n");
-        goto DEVICE_CLASS_ERROR;
+        status = ds310_sensor_read_byte(sensor, address);
+        if (status >= 0)
+        {
+            sensor->shadow[address] = status;
+            __set_bit(address, sensor->shadow_written);
+        }
     }
 
-    /* Create Character Device file */
-    if (device_create(ds310_sensor_class, NULL, ds310_sensor_device_number, NULL, DRIVER_NAME) == NULL)
+    /* Signal finished pressure measurements on the interrupt pin if it is wired */
+    sensor->irq = client->irq;
+    if (sensor->irq > 0)
     {
-        printk(KERN_ERR "ds310_sensor_probe: device_create failed\n");
-        goto DEVICE_FILE_ERROR;
+        status = ds310_sensor_read_byte(sensor, DS310_CFG_REG);
+        if (status < 0 || ds310_sensor_write_byte(sensor, DS310_CFG_REG, status | DS310_INT_PRS) < 0)
+        {
+            printk(KERN_ERR "ds310_sensor_probe: enabling the interrupt failed, polling instead\n");
+            sensor->irq = 0;
+        }
     }
 
-    /* Initialize Character Device file */
-    cdev_init(&ds310_sensor_character_device, &ds310_sensor_file_operations);
+    /* The first sensor keeps the original device file name */
+    sensor->index = ida_alloc(&ds310_sensor_indexes, GFP_KERNEL);
+    if (sensor->index < 0)
+    {
+        status = sensor->index;
+        goto CALIBRATION_ERROR;
+    }
 
-    /* Add Character Device file to the system */
-    if (cdev_add(&ds310_sensor_character_device, ds310_sensor_device_number, 1) == -1)
+    if (sensor->index == 0)
     {
-        printk(KERN_ERR "ds310_sensor_probe: cdev_add failed\n");
-        goto KERNEL_ERROR;
+        snprintf(name, sizeof(name), DRIVER_NAME);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), DRIVER_NAME "%d", sensor->index);
+    }
+
+    if (ds310_sensor_create(sensor, ds310_sensor_acquisition_thread, name) < 0)
+    {
+        status = -ENODEV;
+        goto CREATE_ERROR;
     }
 
     return 0;
 
-KERNEL_ERROR:
-    device_destroy(ds310_sensor_class, ds310_sensor_device_number);
-DEVICE_FILE_ERROR:
-    class_destroy(ds310_sensor_class);
-DEVICE_CLASS_ERROR:
-    unregister_chrdev(ds310_sensor_device_number, DRIVER_NAME);
-DEVICE_NUMBER_ERROR:
-    return -1;
+CREATE_ERROR:
+    ida_free(&ds310_sensor_indexes, sensor->index);
+    kref_put(&sensor->refcount, ds310_sensor_free);
+    return status;
+
+CALIBRATION_ERROR:
+    kfree(sensor);
+    return status;
 }
 
 /**
@@ -207,15 +4582,47 @@ DEVICE_NUMBER_ERROR:
  */
 static void ds310_sensor_remove(struct i2c_client *client)
 {
+    struct ds310_sensor *sensor = i2c_get_clientdata(client);
+
     printk(KERN_INFO "ds310_sensor_remove\n");
 
     /**
      * Remove device file for ds310 sensor
      */
-    cdev_del(&ds310_sensor_character_device);
-    device_destroy(ds310_sensor_class, ds310_sensor_device_number);
-    class_destroy(ds310_sensor_class);
-    unregister_chrdev(ds310_sensor_device_number, DRIVER_NAME);
+    ds310_sensor_destroy(sensor);
+    ida_free(&ds310_sensor_indexes, sensor->index);
+    kref_put(&sensor->refcount, ds310_sensor_free);
+}
+
+/**
+ * @brief Create a virtual sensor with an emulated register model
+ */
+static struct ds310_sensor *ds310_sensor_create_virtual(int index)
+{
+    struct ds310_sensor *sensor = NULL;
+    char name[32];
+
+    sensor = kzalloc(sizeof(*sensor), GFP_KERNEL);
+    if (sensor == NULL)
+    {
+        return NULL;
+    }
+
+    sensor->index = index;
+    sensor->random_state = index + 1;
+    sensor->registers[DS310_MEAS_CFG] = DS310_COEF_RDY | DS310_SENSOR_RDY;
+    sensor->registers[DS310_PRODUCT_ID] = DS310_PRODUCT_ID_VALUE;
+    memcpy(&sensor->registers[DS310_COEF], ds310_sensor_virtual_coefficients, DS310_COEF_LENGTH);
+    ds310_sensor_read_calibration(sensor);
+
+    snprintf(name, sizeof(name), DS310_VIRTUAL_NAME "%d", index);
+    if (ds310_sensor_create(sensor, ds310_sensor_virtual_thread, name) < 0)
+    {
+        kref_put(&sensor->refcount, ds310_sensor_free);
+        return NULL;
+    }
+
+    return sensor;
 }
 
 /**
@@ -234,9 +4641,131 @@ static struct i2c_driver ds310_sensor_driver =
     .id_table = ds310_sensor_id
 };
 
-module_i2c_driver(ds310_sensor_driver);
+/**
+ * @brief Remove all virtual sensors
+ */
+static void ds310_sensor_destroy_virtual(void)
+{
+    int i;
+
+    for (i = 0; i < DS310_MAX_SENSORS; i++)
+    {
+        if (ds310_sensor_virtual[i] != NULL)
+        {
+            ds310_sensor_destroy(ds310_sensor_virtual[i]);
+            kref_put(&ds310_sensor_virtual[i]->refcount, ds310_sensor_free);
+            ds310_sensor_virtual[i] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief This function is called, when the module is loaded
+ */
+static int __init ds310_sensor_init(void)
+{
+    unsigned int i;
+
+    if (acquisition_cpu >= (int)nr_cpu_ids || (acquisition_cpu >= 0 && !cpu_online(acquisition_cpu)))
+    {
+        acquisition_cpu = -1;
+    }
+    acquisition_priority = min(acquisition_priority, MAX_RT_PRIO - 1);
+
+    /* Ring slots are found by masking the sample number */
+    ring_size = roundup_pow_of_two(clamp(ring_size, (unsigned int)DS310_RING_SIZE_MIN, (unsigned int)DS310_RING_SIZE_MAX));
+
+    /* Allocate Device Numbers */
+    if (alloc_chrdev_region(&ds310_sensor_device_number, 0, DS310_MAX_SENSORS, DRIVER_NAME) < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_init: alloc_chrdev_region failed\n");
+        goto DEVICE_NUMBER_ERROR;
+    }
+
+    /* Create Device Class */
+    ds310_sensor_class = class_create(THIS_MODULE, DRIVER_CLASS);
+    if (IS_ERR(ds310_sensor_class))
+    {
+        printk(KERN_ERR "ds310_sensor_init: class_create failed\n");
+        goto DEVICE_CLASS_ERROR;
+    }
+
+    /* Create the merged stream of all sensors */
+    if (ds310_sensor_aggregate_create() < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_init: creating " DS310_AGGREGATE_NAME " failed\n");
+        goto AGGREGATE_ERROR;
+    }
+
+    /* Register the generic netlink family and its publisher */
+    if (ds310_sensor_netlink_create() < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_init: registering the generic netlink family failed\n");
+        goto NETLINK_ERROR;
+    }
+
+    /* Create virtual sensors */
+    for (i = 0; i < min(virtual_sensors, (unsigned int)DS310_MAX_SENSORS); i++)
+    {
+        ds310_sensor_virtual[i] = ds310_sensor_create_virtual(i);
+        if (ds310_sensor_virtual[i] == NULL)
+        {
+            printk(KERN_ERR "ds310_sensor_init: creating virtual sensor %u failed\n", i);
+            goto VIRTUAL_SENSOR_ERROR;
+        }
+    }
+
+    /* Register I2C driver */
+    if (i2c_add_driver(&ds310_sensor_driver) < 0)
+    {
+        printk(KERN_ERR "ds310_sensor_init: i2c_add_driver failed\n");
+        goto VIRTUAL_SENSOR_ERROR;
+    }
+
+    return 0;
+
+VIRTUAL_SENSOR_ERROR:
+    ds310_sensor_destroy_virtual();
+    ds310_sensor_netlink_destroy();
+NETLINK_ERROR:
+    ds310_sensor_aggregate_destroy();
+AGGREGATE_ERROR:
+    class_destroy(ds310_sensor_class);
+DEVICE_CLASS_ERROR:
+    unregister_chrdev_region(ds310_sensor_device_number, DS310_MAX_SENSORS);
+DEVICE_NUMBER_ERROR:
+    return -1;
+}
+
+/**
+ * @brief This function is called, when the module is removed
+ */
+static void __exit ds310_sensor_exit(void)
+{
+    unsigned int i;
+
+    ds310_sensor_netlink_destroy();
+    i2c_del_driver(&ds310_sensor_driver);
+    ds310_sensor_destroy_virtual();
+
+    for (i = 0; i < DS310_MAX_GROUPS; i++)
+    {
+        if (ds310_sensor_sync_groups[i] != NULL)
+        {
+            ds310_sensor_sync_destroy(ds310_sensor_sync_groups[i]);
+        }
+    }
+
+    ds310_sensor_aggregate_destroy();
+
+    class_destroy(ds310_sensor_class);
+    unregister_chrdev_region(ds310_sensor_device_number, DS310_MAX_SENSORS);
+}
+
+module_init(ds310_sensor_init);
+module_exit(ds310_sensor_exit);
 
 MODULE_AUTHOR("elec-tra");
 MODULE_DESCRIPTION("Raspberry Pi driver for the ds310 sensor");
 MODULE_LICENSE("GPL");
-MODULE_VERSION(VERSION);
\ No newline at end of file
+MODULE_VERSION(VERSION);
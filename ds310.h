@@ -0,0 +1,313 @@
+/**
+ * User space interface of the ds310 sensor driver
+ *
+ * The device file returns the selected register value by default. A
+ * reader can switch its file descriptor to a sample stream with the
+ * DS310_IOC_SET_FORMAT ioctl.
+ */
+
+#ifndef DS310_H
+#define DS310_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/**
+ * Read formats of a file descriptor
+ */
+#define DS310_FORMAT_REGISTER 0
+#define DS310_FORMAT_RECORD 1
+#define DS310_FORMAT_COMPRESSED 2
+
+/**
+ * @brief Sample record of the DS310_FORMAT_RECORD stream
+ */
+struct ds310_sample
+{
+    __u64 timestamp;        /* nanoseconds, CLOCK_MONOTONIC unless current_timestamp_clock selects another clock */
+    __u64 sequence;         /* number of the record in the sensor's stream, increases by 1 per record */
+    __s32 pressure_raw;     /* 24 bit two's complement result */
+    __s32 temperature_raw;  /* 24 bit two's complement result */
+    __s32 pressure;         /* millipascal */
+    __s32 temperature;      /* millidegree Celsius */
+    __u32 flags;            /* DS310_SAMPLE_* */
+    __u32 reserved;
+};
+
+/**
+ * Flags of a sample record
+ *
+ * A result is fresh when the sensor measured it since the previous
+ * sample, otherwise the last result is repeated. Samples read from the
+ * sensor FIFO have interpolated timestamps. DS310_SAMPLE_OVERRUN marks
+ * the first record after a gap: a failed acquisition, a sensor reset or
+ * records the reader lost to the producer.
+ */
+#define DS310_SAMPLE_CONFIG 0x00000001              /* the record is a struct ds310_config_marker */
+#define DS310_SAMPLE_FRESH_PRESSURE 0x00000002
+#define DS310_SAMPLE_FRESH_TEMPERATURE 0x00000004
+#define DS310_SAMPLE_FIFO 0x00000008
+#define DS310_SAMPLE_RECOVERED 0x00000010           /* first sample after the recovery reset the sensor */
+#define DS310_SAMPLE_OVERRUN 0x00000020
+
+/**
+ * @brief Configuration marker in the sample stream
+ *
+ * Written to the stream in place of a sample whenever the pressure or
+ * temperature configuration, the measurement mode or CFG_REG is written,
+ * between the samples measured before and after the change. Joining and
+ * leaving a sync group change the measurement mode too, the conversions
+ * a group capture starts do not and are not marked. It has the
+ * size of struct ds310_sample and flags at the same offset, so readers
+ * tell both apart by DS310_SAMPLE_CONFIG. kp and kt are the scale
+ * factors that compensate the raw results that follow.
+ */
+struct ds310_config_marker
+{
+    __u64 timestamp;        /* time of the change, clock of the samples */
+    __u64 sequence;
+    __s32 kp;
+    __s32 kt;
+    __u8 prs_cfg;
+    __u8 tmp_cfg;
+    __u8 meas_cfg;          /* measurement control bits */
+    __u8 cfg_reg;
+    __u32 reserved0;
+    __u32 flags;            /* DS310_SAMPLE_CONFIG */
+    __u32 reserved;
+};
+
+/**
+ * @brief Calibration coefficients and the scale factors in use
+ */
+struct ds310_calibration
+{
+    __s32 c0;
+    __s32 c1;
+    __s32 c00;
+    __s32 c10;
+    __s32 c01;
+    __s32 c11;
+    __s32 c20;
+    __s32 c21;
+    __s32 c30;
+    __s32 kp;
+    __s32 kt;
+};
+
+/**
+ * @brief Cached state of the sample stream
+ *
+ * Served without bus traffic. The rolling window covers the most
+ * recent buffered samples, at most 1024.
+ */
+struct ds310_stats
+{
+    struct ds310_sample latest;
+    __u64 samples;          /* samples acquired since probe */
+    __u64 overruns;         /* times a reader lost buffered samples */
+    __u64 errors;           /* failed bus transfers */
+    __u64 dropped;          /* samples this file descriptor lost */
+    __u32 readers;          /* streaming file descriptors */
+    __u32 window;           /* samples in the rolling window */
+    __s32 pressure_mean;
+    __s32 pressure_min;
+    __s32 pressure_max;
+    __s32 temperature_mean;
+    __s32 temperature_min;
+    __s32 temperature_max;
+};
+
+/**
+ * @brief Header page of the sample ring mapped with mmap()
+ *
+ * The mapping is length bytes long and read only. Sample number n is
+ * stored at data_offset + (n % size) * record_size. head holds the low
+ * 32 bits of the number of samples written so far, so it can be loaded
+ * atomically on 32-bit architectures, and wraps around. It is stored
+ * with release semantics after the samples, so a reader loads it with
+ * acquire semantics before it reads samples. A reader keeps its 64-bit
+ * sample number tail and extends head with
+ *
+ *     head64 = tail + (__u32)(head - (__u32)tail)
+ *
+ * which is exact while the reader is less than 2^32 samples behind. The
+ * producer may be overwriting sample head - size at any time, only
+ * samples from head - size + 1 on are intact. A reader checks head again
+ * after copying to detect overwritten samples.
+ *
+ * Mapped readers select a streaming format so the acquisition runs and
+ * poll() reports new samples, and acknowledge consumed samples by
+ * seeking the file descriptor to the next sample number (SEEK_SET). A
+ * seek beyond head stops at head and returns it. lseek(fd, 0, SEEK_CUR)
+ * returns the current sample number, the starting tail of a reader.
+ */
+struct ds310_ring_header
+{
+    __u32 head;
+    __u32 reserved;
+    __u32 size;             /* samples in the ring, a power of two */
+    __u32 record_size;      /* sizeof(struct ds310_sample) */
+    __u64 data_offset;      /* offset of the first sample */
+    __u64 length;           /* length of the mapping */
+};
+
+/**
+ * Number of ds310 registers, from PSR_B2 (0x00) to COEF_SRCE (0x28)
+ */
+#define DS310_REGISTER_COUNT 0x29
+
+/**
+ * @brief Register dump of DS310_IOC_GET_REGISTERS
+ *
+ * Reading the result registers clears the ready flags, so a dump can
+ * delay the next streamed sample by one measurement.
+ */
+struct ds310_registers
+{
+    __u8 values[DS310_REGISTER_COUNT];
+    __u8 reserved[7];
+};
+
+/**
+ * @brief Recording replayed by a virtual sensor
+ *
+ * The samples are replayed in a loop at the rate of the virtual sensor
+ * with new timestamps. A count of 0 selects the synthetic generator.
+ */
+struct ds310_replay
+{
+    __u64 samples;          /* user pointer to struct ds310_sample[count] */
+    __u32 count;
+    __u32 reserved;         /* must be 0 */
+};
+
+/**
+ * @brief Record of the merged ds310_all stream
+ *
+ * The samples of all sensors are merged in timestamp order and tagged
+ * with the minor number of the sensor's device file.
+ */
+struct ds310_tagged_sample
+{
+    __u32 minor;
+    __u32 reserved;
+    struct ds310_sample sample;
+};
+
+/**
+ * Synchronized groups
+ *
+ * Sensors joined to group N with their sync_group attribute are measured
+ * together on every trigger of the ds310_groupN device file, from its
+ * trigger_rate_hz timer or from any write to it. Reading the device file
+ * returns whole struct ds310_group_record records.
+ */
+#define DS310_GROUP_MAX_MEMBERS 4
+
+struct ds310_group_member
+{
+    __u32 index;            /* sensor number, 0 for ds310_sensor */
+    __s32 pressure_raw;
+    __s32 temperature_raw;
+    __s32 pressure;         /* millipascal */
+    __s32 temperature;      /* millidegree Celsius */
+};
+
+/**
+ * @brief Combined record of a group trigger
+ */
+struct ds310_group_record
+{
+    __u64 timestamp;        /* middle of the pressure conversion starts, clock of the first member */
+    __u32 skew;             /* nanoseconds from the first to the last conversion start */
+    __u32 count;            /* valid members, in the order of the members attribute */
+    struct ds310_group_member members[DS310_GROUP_MAX_MEMBERS];
+};
+
+/**
+ * DS310_FORMAT_COMPRESSED stream
+ *
+ * Key frame:   0x01 'P' 'Y' varint(timestamp) varint(zigzag(pressure_raw))
+ *              varint(zigzag(temperature_raw))
+ * Delta frame: varint(zigzag(timestamp delta - previous delta) << 1)
+ *              varint(zigzag(pressure_raw delta))
+ *              varint(zigzag(temperature_raw delta))
+ *
+ * Config frame: 0x03 'P' 'C' prs_cfg tmp_cfg meas_cfg cfg_reg
+ *              varint(timestamp) varint(zigzag(kp)) varint(zigzag(kt))
+ *
+ * Sequence numbers and quality flags are not transmitted, a key frame
+ * follows every gap: records the reader lost and samples flagged
+ * DS310_SAMPLE_OVERRUN or DS310_SAMPLE_RECOVERED by the producer.
+ *
+ * Varints are little endian base 128. The first byte of a delta frame is
+ * always even, so a decoder can seek to the next key frame by scanning
+ * for the key frame tag. A key frame is emitted every
+ * DS310_KEY_FRAME_INTERVAL samples, after samples were dropped and after
+ * a config frame, which carries a struct ds310_config_marker.
+ */
+#define DS310_KEY_FRAME_TAG 0x01
+#define DS310_KEY_FRAME_MAGIC0 'P'
+#define DS310_KEY_FRAME_MAGIC1 'Y'
+#define DS310_CONFIG_FRAME_TAG 0x03
+#define DS310_CONFIG_FRAME_MAGIC0 'P'
+#define DS310_CONFIG_FRAME_MAGIC1 'C'
+#define DS310_KEY_FRAME_INTERVAL 64
+#define DS310_FRAME_MAX_LENGTH 32
+
+/**
+ * Generic netlink family
+ *
+ * While a socket is subscribed to the DS310_GENL_GROUP_SAMPLES multicast
+ * group, every sensor streams and the driver publishes its samples in
+ * DS310_CMD_SAMPLES messages, one per sensor and batch, with
+ * DS310_ATTR_MINOR and DS310_ATTR_SAMPLES, an array of struct
+ * ds310_sample records including configuration markers.
+ *
+ * DS310_CMD_GET_CONFIG with DS310_ATTR_MINOR replies with the
+ * configuration attributes and the scale factors of that sensor.
+ * DS310_CMD_SET_CONFIG with DS310_ATTR_MINOR writes the given
+ * configuration attributes, the measurement mode last, and needs
+ * CAP_NET_ADMIN.
+ */
+#define DS310_GENL_NAME "ds310"
+#define DS310_GENL_VERSION 1
+#define DS310_GENL_GROUP_SAMPLES "samples"
+
+enum ds310_genl_command
+{
+    DS310_CMD_UNSPEC,
+    DS310_CMD_SAMPLES,
+    DS310_CMD_GET_CONFIG,
+    DS310_CMD_SET_CONFIG,
+    __DS310_CMD_MAX,
+};
+#define DS310_CMD_MAX (__DS310_CMD_MAX - 1)
+
+enum ds310_genl_attribute
+{
+    DS310_ATTR_UNSPEC,
+    DS310_ATTR_MINOR,       /* u32, minor number of the sensor's device file */
+    DS310_ATTR_SAMPLES,     /* binary, struct ds310_sample[] */
+    DS310_ATTR_PRS_CFG,     /* u8 */
+    DS310_ATTR_TMP_CFG,     /* u8 */
+    DS310_ATTR_MEAS_CFG,    /* u8, measurement control bits */
+    DS310_ATTR_CFG_REG,     /* u8 */
+    DS310_ATTR_KP,          /* s32, pressure scale factor */
+    DS310_ATTR_KT,          /* s32, temperature scale factor */
+    __DS310_ATTR_MAX,
+};
+#define DS310_ATTR_MAX (__DS310_ATTR_MAX - 1)
+
+/**
+ * ioctl commands
+ */
+#define DS310_IOC_MAGIC 'd'
+#define DS310_IOC_SET_FORMAT _IOW(DS310_IOC_MAGIC, 0, __u32)
+#define DS310_IOC_GET_CALIBRATION _IOR(DS310_IOC_MAGIC, 1, struct ds310_calibration)
+#define DS310_IOC_GET_STATS _IOR(DS310_IOC_MAGIC, 2, struct ds310_stats)
+#define DS310_IOC_LOAD_REPLAY _IOW(DS310_IOC_MAGIC, 3, struct ds310_replay)
+#define DS310_IOC_GET_REGISTERS _IOR(DS310_IOC_MAGIC, 4, struct ds310_registers)
+
+#endif /* DS310_H */
@@ -0,0 +1,65 @@
+/**
+ * Altitude lookup table of the ds310 sensor driver
+ *
+ * Shared by the driver and libpicy, so the altitude attribute and
+ * picy_altitude() return the same values for the same pressure.
+ */
+
+#ifndef DS310_ALTITUDE_H
+#define DS310_ALTITUDE_H
+
+#include <linux/types.h>
+
+/**
+ * Reference pressure and range of the altitude lookup table
+ */
+#define DS310_SEA_LEVEL_PRESSURE 101325
+#define DS310_ALTITUDE_RATIO_SHIFT 24
+#define DS310_ALTITUDE_STEP_SHIFT 16
+#define DS310_ALTITUDE_RATIO_MIN (1 << (DS310_ALTITUDE_RATIO_SHIFT - 2))
+
+/**
+ * Altitude in millimetres for the pressure ratio p / p0 from 0.25 to
+ * 1.25 in steps of 1/256, following h = 44330 * (1 - (p / p0)^(1 / 5.255)).
+ * Linear interpolation between the entries stays within 0.12 m of the
+ * exact formula between 300 hPa and 1200 hPa, and within 0.03 m between
+ * 700 hPa and 1100 hPa.
+ */
+static const __s32 ds310_altitude_table[] =
+{
+    10279088, 10178477, 10079111, 9980957, 9883983, 9788156, 9693447, 9599828,
+    9507270, 9415747, 9325234, 9235706, 9147139, 9059511, 8972799, 8886984,
+    8802043, 8717957, 8634708, 8552277, 8470647, 8389799, 8309718, 8230387,
+    8151792, 8073916, 7996745, 7920266, 7844464, 7769326, 7694840, 7620993,
+    7547772, 7475167, 7403165, 7331755, 7260927, 7190670, 7120975, 7051830,
+    6983227, 6915156, 6847608, 6780573, 6714045, 6648013, 6582470, 6517407,
+    6452818, 6388693, 6325027, 6261811, 6199039, 6136703, 6074797, 6013315,
+    5952249, 5891595, 5831344, 5771493, 5712034, 5652962, 5594271, 5535956,
+    5478012, 5420434, 5363215, 5306352, 5249840, 5193673, 5137847, 5082357,
+    5027199, 4972368, 4917861, 4863672, 4809798, 4756235, 4702979, 4650025,
+    4597370, 4545011, 4492943, 4441163, 4389668, 4338454, 4287517, 4236854,
+    4186462, 4136338, 4086479, 4036881, 3987541, 3938457, 3889626, 3841044,
+    3792708, 3744617, 3696767, 3649156, 3601780, 3554638, 3507727, 3461044,
+    3414586, 3368353, 3322340, 3276545, 3230967, 3185603, 3140451, 3095509,
+    3050774, 3006244, 2961918, 2917793, 2873866, 2830137, 2786604, 2743263,
+    2700114, 2657154, 2614382, 2571796, 2529394, 2487174, 2445134, 2403273,
+    2361590, 2320081, 2278747, 2237585, 2196593, 2155770, 2115115, 2074625,
+    2034300, 1994138, 1954138, 1914297, 1874615, 1835090, 1795721, 1756507,
+    1717445, 1678535, 1639776, 1601166, 1562704, 1524388, 1486218, 1448192,
+    1410309, 1372568, 1334967, 1297505, 1260182, 1222996, 1185946, 1149031,
+    1112250, 1075601, 1039084, 1002698, 966441, 930313, 894312, 858437,
+    822689, 787065, 751564, 716186, 680930, 645794, 610778, 575882,
+    541103, 506441, 471896, 437466, 403151, 368949, 334860, 300883,
+    267017, 233262, 199617, 166080, 132651, 99329, 66114, 33004,
+    0, -32900, -65697, -98391, -130983, -163474, -195864, -228154,
+    -260344, -292436, -324431, -356328, -388128, -419833, -451442, -482957,
+    -514377, -545704, -576939, -608081, -639131, -670091, -700960, -731740,
+    -762430, -793032, -823546, -853972, -884311, -914564, -944731, -974813,
+    -1004810, -1034723, -1064552, -1094298, -1123961, -1153542, -1183042, -1212460,
+    -1241798, -1271055, -1300233, -1329332, -1358352, -1387294, -1416158, -1444945,
+    -1473655, -1502288, -1530846, -1559328, -1587736, -1616068, -1644327, -1672511,
+    -1700623, -1728662, -1756628, -1784522, -1812344, -1840096, -1867776, -1895386,
+    -1922927
+};
+
+#endif /* DS310_ALTITUDE_H */
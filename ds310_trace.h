@@ -0,0 +1,73 @@
+/**
+ * Tracepoints of the ds310 sensor driver
+ *
+ * ds310:ds310_sample fires for every record appended to the stream of a
+ * sensor, with the complete payload, so BPF programs and bpftrace can
+ * aggregate samples in the kernel:
+ *
+ *     bpftrace -e 'tracepoint:ds310:ds310_sample { @[args->minor] = hist(args->pressure); }'
+ *
+ * Without DS310_FEATURE_TRACE the trace functions are empty and the
+ * module defines no events.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ds310
+
+#if !defined(DS310_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define DS310_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "ds310.h"
+
+#if !DS310_FEATURE_TRACE
+#undef TRACE_EVENT
+#define TRACE_EVENT(name, proto, ...) \
+static inline void trace_ ## name(proto) {}
+#endif
+
+/**
+ * @brief Record appended to the stream of the sensor with this minor
+ */
+TRACE_EVENT(ds310_sample,
+
+    TP_PROTO(unsigned int minor, const struct ds310_sample *sample),
+
+    TP_ARGS(minor, sample),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, flags)
+        __field(u64, sequence)
+        __field(u64, timestamp)
+        __field(s32, pressure_raw)
+        __field(s32, temperature_raw)
+        __field(s32, pressure)
+        __field(s32, temperature)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->flags = sample->flags;
+        __entry->sequence = sample->sequence;
+        __entry->timestamp = sample->timestamp;
+        __entry->pressure_raw = sample->pressure_raw;
+        __entry->temperature_raw = sample->temperature_raw;
+        __entry->pressure = sample->pressure;
+        __entry->temperature = sample->temperature;
+    ),
+
+    TP_printk("minor=%u sequence=%llu timestamp=%llu pressure_raw=%d temperature_raw=%d pressure=%d temperature=%d flags=%#x",
+              __entry->minor, __entry->sequence, __entry->timestamp, __entry->pressure_raw,
+              __entry->temperature_raw, __entry->pressure, __entry->temperature, __entry->flags)
+);
+
+#endif /* DS310_TRACE_H */
+
+/* The header is not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ds310_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,225 @@
+/**
+ * picy-exporter serves the cached state of the ds310 sensor driver in
+ * the Prometheus text format
+ *
+ * Every scrape issues a single DS310_IOC_GET_STATS ioctl, which only
+ * copies the driver's cached state and never causes bus traffic. The
+ * exporter listens on a loopback TCP port or on a Unix socket.
+ *
+ * Usage: picy-exporter [-d device] [-p port | -u socket path]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "picy.h"
+
+/**
+ * @brief Listen on 127.0.0.1:port or on a Unix socket path
+ */
+static int picy_listen(unsigned int port, const char *socket_path)
+{
+    struct sockaddr_in inet_address = {0};
+    struct sockaddr_un unix_address = {0};
+    int fd, enable = 1;
+
+    if (socket_path != NULL)
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        unix_address.sun_family = AF_UNIX;
+        strncpy(unix_address.sun_path, socket_path, sizeof(unix_address.sun_path) - 1);
+        unlink(socket_path);
+        if (bind(fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        inet_address.sin_family = AF_INET;
+        inet_address.sin_port = htons(port);
+        inet_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&inet_address, sizeof(inet_address)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 8) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Format the driver state as Prometheus metrics
+ */
+static int picy_format_metrics(const struct ds310_stats *stats, char *buffer, size_t size)
+{
+    return snprintf(buffer, size,
+        "# TYPE picy_samples_total counter\n"
+        "picy_samples_total %llu\n"
+        "# TYPE picy_overruns_total counter\n"
+        "picy_overruns_total %llu\n"
+        "# TYPE picy_errors_total counter\n"
+        "picy_errors_total %llu\n"
+        "# TYPE picy_readers gauge\n"
+        "picy_readers %u\n"
+        "# TYPE picy_window_samples gauge\n"
+        "picy_window_samples %u\n"
+        "# TYPE picy_timestamp_seconds gauge\n"
+        "picy_timestamp_seconds %.9f\n"
+        "# TYPE picy_pressure_pascal gauge\n"
+        "picy_pressure_pascal %.3f\n"
+        "picy_pressure_pascal{stat=\"mean\"} %.3f\n"
+        "picy_pressure_pascal{stat=\"min\"} %.3f\n"
+        "picy_pressure_pascal{stat=\"max\"} %.3f\n"
+        "# TYPE picy_temperature_celsius gauge\n"
+        "picy_temperature_celsius %.3f\n"
+        "picy_temperature_celsius{stat=\"mean\"} %.3f\n"
+        "picy_temperature_celsius{stat=\"min\"} %.3f\n"
+        "picy_temperature_celsius{stat=\"max\"} %.3f\n",
+        (unsigned long long)stats->samples,
+        (unsigned long long)stats->overruns,
+        (unsigned long long)stats->errors,
+        stats->readers,
+        stats->window,
+        stats->latest.timestamp / 1e9,
+        stats->latest.pressure / 1e3,
+        stats->pressure_mean / 1e3,
+        stats->pressure_min / 1e3,
+        stats->pressure_max / 1e3,
+        stats->latest.temperature / 1e3,
+        stats->temperature_mean / 1e3,
+        stats->temperature_min / 1e3,
+        stats->temperature_max / 1e3);
+}
+
+/**
+ * @brief Answer one HTTP request with the current metrics
+ */
+static void picy_serve(int client, int device)
+{
+    struct ds310_stats stats = {0};
+    struct timeval timeout = { .tv_sec = 1 };
+    char request[1024], body[2048], header[256];
+    int body_length, header_length;
+
+    /* A stalled client must not hold up other scrapes */
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    /* The request is not inspected, every path returns the metrics */
+    if (recv(client, request, sizeof(request), 0) <= 0)
+    {
+        return;
+    }
+
+    if (ioctl(device, DS310_IOC_GET_STATS, &stats) < 0)
+    {
+        header_length = snprintf(header, sizeof(header),
+            "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        send(client, header, header_length, MSG_NOSIGNAL);
+        return;
+    }
+
+    body_length = picy_format_metrics(&stats, body, sizeof(body));
+    header_length = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+        body_length);
+
+    send(client, header, header_length, MSG_NOSIGNAL);
+    send(client, body, body_length, MSG_NOSIGNAL);
+}
+
+int main(int argc, char **argv)
+{
+    const char *device_path = "/dev/ds310_sensor", *socket_path = NULL;
+    unsigned int port = 9310;
+    int device, server, client, option;
+
+    while ((option = getopt(argc, argv, "d:p:u:")) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            device_path = optarg;
+            break;
+        case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] [-p port | -u socket path]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The descriptor stays in register format and never starts streaming */
+    device = open(device_path, O_RDONLY | O_CLOEXEC);
+    if (device < 0)
+    {
+        perror(device_path);
+        return EXIT_FAILURE;
+    }
+
+    server = picy_listen(port, socket_path);
+    if (server < 0)
+    {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    while (1)
+    {
+        client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        picy_serve(client, device);
+        close(client);
+    }
+
+    close(server);
+    close(device);
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,263 @@
+/**
+ * picy-fuzz is a smoke driver that runs sequences of writes, reads,
+ * seeks and ioctls generated by libFuzzer against a ds310 device file
+ *
+ * It is not coverage guided: the driver code under test runs in the
+ * kernel and is not instrumented, only this harness is, so libFuzzer
+ * mutates inputs without feedback from the driver. Treat it as a random
+ * operation generator with a liveness check, not as a fuzzer of the
+ * parsers.
+ *
+ * Every input is a list of operations on a fresh file descriptor: the
+ * first byte of an operation selects it, the following bytes are its
+ * arguments. Before the sequence the synthetic generator and the
+ * configuration registers read at startup are restored, so inputs start
+ * from the same sensor state as far as the file interface can reset it.
+ * After the sequence the descriptor is closed and a monitor descriptor,
+ * streaming records since the start, must receive new samples within
+ * PICY_FUZZ_TIMEOUT_MS, otherwise the target aborts. A kernel oops, a
+ * hang or a stopped acquisition all show as a crash. A crash may still
+ * depend on state the earlier inputs left in the driver.
+ *
+ * Run it as root against a virtual sensor, never against hardware:
+ *
+ *     PICY_FUZZ_DEVICE=/dev/ds310_virtual0 ./picy-fuzz -max_len=256
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "ds310.h"
+
+#define PICY_FUZZ_TIMEOUT_MS 2000
+#define PICY_FUZZ_BUFFER 4096
+
+/* PRS_CFG, TMP_CFG, MEAS_CFG and CFG_REG, restored before every input */
+static const uint8_t picy_fuzz_registers[] = { 0x06, 0x07, 0x08, 0x09 };
+
+static const char *picy_fuzz_device = "/dev/ds310_virtual0";
+static int picy_fuzz_monitor = -1;
+static struct ds310_registers picy_fuzz_initial;
+
+/**
+ * @brief Operations selected by the first byte of an operation
+ */
+enum picy_fuzz_operation
+{
+    PICY_FUZZ_WRITE,
+    PICY_FUZZ_READ,
+    PICY_FUZZ_SEEK,
+    PICY_FUZZ_SET_FORMAT,
+    PICY_FUZZ_GET_CALIBRATION,
+    PICY_FUZZ_GET_STATS,
+    PICY_FUZZ_GET_REGISTERS,
+    PICY_FUZZ_LOAD_REPLAY,
+    PICY_FUZZ_IOCTL,
+    PICY_FUZZ_MMAP,
+    PICY_FUZZ_POLL,
+    PICY_FUZZ_OPERATIONS
+};
+
+/**
+ * @brief Take up to length bytes of the input, the rest of value is
+ *        zeroed, returns the number taken
+ */
+static size_t picy_fuzz_take(const uint8_t **data, size_t *size, void *value, size_t length)
+{
+    memset(value, 0, length);
+    length = length < *size ? length : *size;
+    memcpy(value, *data, length);
+    *data += length;
+    *size -= length;
+
+    return length;
+}
+
+/**
+ * @brief Select the synthetic generator and restore the configuration
+ *        read at startup
+ */
+static void picy_fuzz_reset(int fd)
+{
+    struct ds310_replay synthetic = {0};
+    uint8_t write_buffer[2];
+    size_t i;
+
+    if (ioctl(fd, DS310_IOC_LOAD_REPLAY, &synthetic) < 0)
+    {
+        perror("DS310_IOC_LOAD_REPLAY");
+        abort();
+    }
+
+    for (i = 0; i < sizeof(picy_fuzz_registers); i++)
+    {
+        write_buffer[0] = picy_fuzz_registers[i];
+        write_buffer[1] = picy_fuzz_initial.values[picy_fuzz_registers[i]];
+        if (write(fd, write_buffer, sizeof(write_buffer)) != sizeof(write_buffer))
+        {
+            perror("restoring the configuration");
+            abort();
+        }
+    }
+}
+
+/**
+ * @brief Read all samples the monitor has buffered
+ */
+static void picy_fuzz_drain(void)
+{
+    struct ds310_sample batch[256];
+
+    while (read(picy_fuzz_monitor, batch, sizeof(batch)) > 0)
+    {
+    }
+}
+
+/**
+ * @brief Abort unless the acquisition still produces samples
+ */
+static void picy_fuzz_check_acquisition(void)
+{
+    struct pollfd monitor = { .fd = picy_fuzz_monitor, .events = POLLIN };
+    struct ds310_sample sample;
+
+    picy_fuzz_drain();
+
+    if (poll(&monitor, 1, PICY_FUZZ_TIMEOUT_MS) <= 0 || read(picy_fuzz_monitor, &sample, sizeof(sample)) <= 0)
+    {
+        fprintf(stderr, "%s: no samples for %d ms\n", picy_fuzz_device, PICY_FUZZ_TIMEOUT_MS);
+        abort();
+    }
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    uint32_t format = DS310_FORMAT_RECORD;
+
+    (void)argc;
+    (void)argv;
+
+    if (getenv("PICY_FUZZ_DEVICE") != NULL)
+    {
+        picy_fuzz_device = getenv("PICY_FUZZ_DEVICE");
+    }
+
+    picy_fuzz_monitor = open(picy_fuzz_device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (picy_fuzz_monitor < 0 || ioctl(picy_fuzz_monitor, DS310_IOC_SET_FORMAT, &format) < 0 ||
+        ioctl(picy_fuzz_monitor, DS310_IOC_GET_REGISTERS, &picy_fuzz_initial) < 0)
+    {
+        perror(picy_fuzz_device);
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static uint8_t buffer[PICY_FUZZ_BUFFER];
+    static struct ds310_sample replay[64];
+    struct ds310_replay load = {0};
+    struct pollfd event = {0};
+    uint8_t operation, length;
+    uint32_t value, command;
+    int64_t offset;
+    void *mapping;
+    int fd;
+
+    fd = open(picy_fuzz_device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(picy_fuzz_device);
+        abort();
+    }
+
+    picy_fuzz_reset(fd);
+
+    while (picy_fuzz_take(&data, &size, &operation, 1))
+    {
+        switch (operation % PICY_FUZZ_OPERATIONS)
+        {
+        case PICY_FUZZ_WRITE:
+            picy_fuzz_take(&data, &size, &length, 1);
+            length = picy_fuzz_take(&data, &size, buffer, length % 8);
+            (void)!write(fd, buffer, length);
+            break;
+
+        case PICY_FUZZ_READ:
+            picy_fuzz_take(&data, &size, &value, sizeof(value));
+            (void)!read(fd, buffer, value % (sizeof(buffer) + 1));
+            break;
+
+        case PICY_FUZZ_SEEK:
+            picy_fuzz_take(&data, &size, &offset, sizeof(offset));
+            picy_fuzz_take(&data, &size, &value, 1);
+            lseek(fd, offset, value % 4);
+            break;
+
+        case PICY_FUZZ_SET_FORMAT:
+            picy_fuzz_take(&data, &size, &value, sizeof(value));
+            ioctl(fd, DS310_IOC_SET_FORMAT, &value);
+            break;
+
+        case PICY_FUZZ_GET_CALIBRATION:
+            ioctl(fd, DS310_IOC_GET_CALIBRATION, buffer);
+            break;
+
+        case PICY_FUZZ_GET_STATS:
+            ioctl(fd, DS310_IOC_GET_STATS, buffer);
+            break;
+
+        case PICY_FUZZ_GET_REGISTERS:
+            ioctl(fd, DS310_IOC_GET_REGISTERS, buffer);
+            break;
+
+        case PICY_FUZZ_LOAD_REPLAY:
+            picy_fuzz_take(&data, &size, &length, 1);
+            load.count = picy_fuzz_take(&data, &size, replay, (length % 65) * sizeof(replay[0])) / sizeof(replay[0]);
+            load.samples = (uintptr_t)replay;
+            picy_fuzz_take(&data, &size, &load.reserved, 1);
+            ioctl(fd, DS310_IOC_LOAD_REPLAY, &load);
+            break;
+
+        case PICY_FUZZ_IOCTL:
+            /* Unknown and malformed commands, with a valid buffer as argument */
+            picy_fuzz_take(&data, &size, &command, sizeof(command));
+            picy_fuzz_take(&data, &size, buffer, 64);
+            ioctl(fd, command, buffer);
+            break;
+
+        case PICY_FUZZ_MMAP:
+            picy_fuzz_take(&data, &size, &value, sizeof(value));
+            mapping = mmap(NULL, (value % 64 + 1) * 4096, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                memcpy(buffer, mapping, 64);
+                munmap(mapping, (value % 64 + 1) * 4096);
+            }
+            break;
+
+        case PICY_FUZZ_POLL:
+            event.fd = fd;
+            event.events = POLLIN | POLLOUT;
+            poll(&event, 1, 0);
+            break;
+        }
+    }
+
+    close(fd);
+
+    picy_fuzz_check_acquisition();
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+/**
+ * picy-recorder writes the sample stream of the ds310 sensor into
+ * memory-mapped columnar segment files
+ *
+ * Samples are read in batches as records and appended to the columns of
+ * the current segment. The segment header is committed once per commit
+ * interval after the columns are flushed. Segments are named
+ * picy-<number>.seg in the output directory and can be mapped by readers
+ * without parsing, see struct picy_segment_header.
+ *
+ * Usage: picy-recorder [-d device] [-o directory] [-n capacity]
+ *                      [-i index stride] [-c commit interval ms]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "picy.h"
+
+#define PICY_PAGE_ALIGN(x) (((x) + 4095) & ~(uint64_t)4095)
+#define PICY_BATCH 256
+
+/**
+ * @brief Mapped segment file
+ */
+struct picy_segment
+{
+    int fd;
+    uint8_t *base;
+    size_t size;
+    struct picy_segment_header *header;
+    uint64_t *timestamps;
+    int32_t *pressures;
+    int32_t *temperatures;
+    uint64_t *index;
+    uint64_t written;
+};
+
+static volatile sig_atomic_t picy_running = 1;
+
+/**
+ * @brief Stop recording on SIGINT or SIGTERM
+ */
+static void picy_stop(int signal_number)
+{
+    (void)signal_number;
+    picy_running = 0;
+}
+
+/**
+ * @brief Return CLOCK_MONOTONIC in milliseconds
+ */
+static uint64_t picy_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Create, preallocate and map the next segment file
+ */
+static int picy_segment_open(struct picy_segment *segment, const char *directory, unsigned int number,
+                             uint64_t capacity, uint64_t stride)
+{
+    struct picy_segment_header *header;
+    char path[4096];
+    uint64_t offset, timestamp_offset, pressure_offset, temperature_offset, index_offset;
+    int status;
+
+    snprintf(path, sizeof(path), "%s/picy-%06u.seg", directory, number);
+
+    segment->fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (segment->fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+
+    /* Column layout, every column starts on a page */
+    offset = PICY_SEGMENT_HEADER_SIZE;
+    timestamp_offset = offset;
+    offset = PICY_PAGE_ALIGN(offset + capacity * sizeof(uint64_t));
+    pressure_offset = offset;
+    offset = PICY_PAGE_ALIGN(offset + capacity * sizeof(int32_t));
+    temperature_offset = offset;
+    offset = PICY_PAGE_ALIGN(offset + capacity * sizeof(int32_t));
+    index_offset = offset;
+    offset = PICY_PAGE_ALIGN(offset + (capacity + stride - 1) / stride * sizeof(uint64_t));
+
+    /* Reserve the blocks up front so appending never runs out of space */
+    status = posix_fallocate(segment->fd, 0, offset);
+    if (status != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(status));
+        close(segment->fd);
+        unlink(path);
+        return -1;
+    }
+
+    segment->base = mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->base == MAP_FAILED)
+    {
+        perror("mmap");
+        close(segment->fd);
+        unlink(path);
+        return -1;
+    }
+
+    segment->size = offset;
+    segment->header = header = (struct picy_segment_header *)segment->base;
+    segment->timestamps = (uint64_t *)(segment->base + timestamp_offset);
+    segment->pressures = (int32_t *)(segment->base + pressure_offset);
+    segment->temperatures = (int32_t *)(segment->base + temperature_offset);
+    segment->index = (uint64_t *)(segment->base + index_offset);
+    segment->written = 0;
+
+    header->version = PICY_SEGMENT_VERSION;
+    header->state = PICY_SEGMENT_OPEN;
+    header->capacity = capacity;
+    header->count = 0;
+    header->timestamp_offset = timestamp_offset;
+    header->pressure_offset = pressure_offset;
+    header->temperature_offset = temperature_offset;
+    header->index_offset = index_offset;
+    header->index_stride = stride;
+
+    /* The magic is written last, a torn header is never valid */
+    msync(segment->base, PICY_SEGMENT_HEADER_SIZE, MS_SYNC);
+    memcpy(header->magic, PICY_SEGMENT_MAGIC, sizeof(header->magic));
+    msync(segment->base, PICY_SEGMENT_HEADER_SIZE, MS_SYNC);
+
+    return 0;
+}
+
+/**
+ * @brief Flush the columns, then publish the written samples
+ */
+static void picy_segment_commit(struct picy_segment *segment)
+{
+    struct picy_segment_header *header = segment->header;
+
+    if (segment->written == header->count)
+    {
+        return;
+    }
+
+    msync(segment->base + PICY_SEGMENT_HEADER_SIZE, segment->size - PICY_SEGMENT_HEADER_SIZE, MS_SYNC);
+
+    if (header->count == 0)
+    {
+        header->first_timestamp = segment->timestamps[0];
+    }
+    header->last_timestamp = segment->timestamps[segment->written - 1];
+    __atomic_store_n(&header->count, segment->written, __ATOMIC_RELEASE);
+
+    msync(segment->base, PICY_SEGMENT_HEADER_SIZE, MS_SYNC);
+}
+
+/**
+ * @brief Commit, mark closed and unmap a segment
+ */
+static void picy_segment_close(struct picy_segment *segment)
+{
+    picy_segment_commit(segment);
+
+    segment->header->state = PICY_SEGMENT_CLOSED;
+    msync(segment->base, PICY_SEGMENT_HEADER_SIZE, MS_SYNC);
+
+    munmap(segment->base, segment->size);
+    close(segment->fd);
+    segment->base = NULL;
+}
+
+/**
+ * @brief Append a sample to the columns of a segment
+ */
+static void picy_segment_append(struct picy_segment *segment, const struct ds310_sample *sample)
+{
+    uint64_t position = segment->written;
+
+    segment->timestamps[position] = sample->timestamp;
+    segment->pressures[position] = sample->pressure;
+    segment->temperatures[position] = sample->temperature;
+
+    if (position % segment->header->index_stride == 0)
+    {
+        segment->index[position / segment->header->index_stride] = sample->timestamp;
+    }
+
+    segment->written++;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = "/dev/ds310_sensor", *directory = ".";
+    uint64_t capacity = 1 << 20, stride = 1024, interval = 1000, last_commit;
+    struct ds310_sample batch[PICY_BATCH];
+    struct picy_segment segment = {0};
+    struct sigaction action = {0};
+    unsigned int number = 0;
+    uint32_t format = DS310_FORMAT_RECORD;
+    ssize_t length;
+    size_t i;
+    int fd, option;
+
+    while ((option = getopt(argc, argv, "d:o:n:i:c:")) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'o':
+            directory = optarg;
+            break;
+        case 'n':
+            capacity = strtoull(optarg, NULL, 0);
+            break;
+        case 'i':
+            stride = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            interval = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] [-o directory] [-n capacity] [-i index stride] [-c commit interval ms]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (capacity == 0 || stride == 0)
+    {
+        fprintf(stderr, "capacity and index stride must not be 0\n");
+        return EXIT_FAILURE;
+    }
+
+    action.sa_handler = picy_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+
+    if (ioctl(fd, DS310_IOC_SET_FORMAT, &format) < 0)
+    {
+        perror("DS310_IOC_SET_FORMAT");
+        return EXIT_FAILURE;
+    }
+
+    /* Continue numbering after existing segments */
+    while (1)
+    {
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/picy-%06u.seg", directory, number);
+        if (access(path, F_OK) != 0)
+        {
+            break;
+        }
+        number++;
+    }
+
+    if (picy_segment_open(&segment, directory, number++, capacity, stride) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    last_commit = picy_now_ms();
+
+    while (picy_running)
+    {
+        length = read(fd, batch, sizeof(batch));
+        if (length < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+
+        for (i = 0; i < length / sizeof(struct ds310_sample); i++)
+        {
+            /* The columns hold compensated values, configuration markers are not needed */
+            if (batch[i].flags & DS310_SAMPLE_CONFIG)
+            {
+                continue;
+            }
+
+            if (segment.written == capacity)
+            {
+                picy_segment_close(&segment);
+                if (picy_segment_open(&segment, directory, number++, capacity, stride) < 0)
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+
+            picy_segment_append(&segment, &batch[i]);
+        }
+
+        if (picy_now_ms() - last_commit >= interval)
+        {
+            picy_segment_commit(&segment);
+            last_commit = picy_now_ms();
+        }
+    }
+
+    picy_segment_close(&segment);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
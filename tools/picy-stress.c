@@ -0,0 +1,303 @@
+/**
+ * picy-stress runs streaming readers and configuration writers against
+ * one ds310 device file at the same time
+ *
+ * Every reader streams records on its own file descriptor and checks
+ * that the sequence numbers are continuous. A jump is only accepted on a
+ * record flagged DS310_SAMPLE_OVERRUN and counted as lost. Every writer
+ * writes configuration registers with the two byte protocol and reads
+ * them back with DS310_IOC_GET_REGISTERS. Writers sharing a register
+ * take turns, so a read back value differing from the written one is a
+ * driver error.
+ *
+ * The test runs once for every reader count in the list and reports the
+ * throughput of each run. The exit status is non-zero if any check
+ * failed.
+ *
+ * Usage: picy-stress [-d device] [-r readers[,readers...]] [-w writers]
+ *                    [-t seconds]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "ds310.h"
+
+#define PICY_BATCH 256
+#define PICY_MAX_THREADS 256
+
+/* Configuration registers, writing them does not stop a virtual sensor */
+static const uint8_t picy_registers[] = { 0x06, 0x07, 0x09 };
+static pthread_mutex_t picy_register_locks[sizeof(picy_registers)] =
+{
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *picy_device = "/dev/ds310_virtual0";
+static volatile int picy_running;
+
+/**
+ * @brief Counters of one reader or writer thread
+ */
+struct picy_worker
+{
+    pthread_t thread;
+    unsigned int index;
+    int failed;
+    uint64_t records;
+    uint64_t lost;
+    uint64_t sequence_errors;
+    uint64_t writes;
+    uint64_t mismatches;
+};
+
+/**
+ * @brief Return CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t picy_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Stream records and check their sequence numbers
+ */
+static void *picy_reader(void *data)
+{
+    struct picy_worker *worker = data;
+    struct ds310_sample batch[PICY_BATCH];
+    uint32_t format = DS310_FORMAT_RECORD;
+    uint64_t expected = 0;
+    int fd, started = 0;
+    ssize_t length;
+    size_t i;
+
+    fd = open(picy_device, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || ioctl(fd, DS310_IOC_SET_FORMAT, &format) < 0)
+    {
+        perror(picy_device);
+        worker->failed = 1;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    while (picy_running)
+    {
+        length = read(fd, batch, sizeof(batch));
+        if (length < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            worker->failed = 1;
+            break;
+        }
+
+        for (i = 0; i < length / sizeof(struct ds310_sample); i++)
+        {
+            if (started && batch[i].sequence != expected)
+            {
+                if ((batch[i].flags & DS310_SAMPLE_OVERRUN) && batch[i].sequence > expected)
+                {
+                    worker->lost += batch[i].sequence - expected;
+                }
+                else
+                {
+                    fprintf(stderr, "reader %u: sequence %llu after %llu\n", worker->index,
+                            (unsigned long long)batch[i].sequence, (unsigned long long)expected - 1);
+                    worker->sequence_errors++;
+                }
+            }
+
+            started = 1;
+            expected = batch[i].sequence + 1;
+            worker->records++;
+        }
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+/**
+ * @brief Write configuration registers and read them back
+ */
+static void *picy_writer(void *data)
+{
+    struct picy_worker *worker = data;
+    struct ds310_registers registers;
+    unsigned int random_state = worker->index + 1;
+    uint8_t buffer[2];
+    size_t slot;
+    int fd;
+
+    fd = open(picy_device, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(picy_device);
+        worker->failed = 1;
+        return NULL;
+    }
+
+    while (picy_running)
+    {
+        slot = rand_r(&random_state) % sizeof(picy_registers);
+        buffer[0] = picy_registers[slot];
+        buffer[1] = rand_r(&random_state);
+
+        pthread_mutex_lock(&picy_register_locks[slot]);
+        if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer) || ioctl(fd, DS310_IOC_GET_REGISTERS, &registers) < 0)
+        {
+            pthread_mutex_unlock(&picy_register_locks[slot]);
+            perror("writing configuration");
+            worker->failed = 1;
+            break;
+        }
+        pthread_mutex_unlock(&picy_register_locks[slot]);
+
+        if (registers.values[buffer[0]] != buffer[1])
+        {
+            fprintf(stderr, "writer %u: register 0x%02x reads 0x%02x after writing 0x%02x\n", worker->index,
+                    buffer[0], registers.values[buffer[0]], buffer[1]);
+            worker->mismatches++;
+        }
+        worker->writes++;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+/**
+ * @brief Run readers and writers for a number of seconds and report,
+ *        returns 0 if all checks passed
+ */
+static int picy_run(unsigned int readers, unsigned int writers, unsigned int seconds)
+{
+    static struct picy_worker workers[PICY_MAX_THREADS];
+    struct picy_worker total = {0};
+    unsigned int i, started;
+    uint64_t start;
+    double duration;
+
+    memset(workers, 0, sizeof(workers));
+    picy_running = 1;
+    start = picy_now_ns();
+
+    for (started = 0; started < readers + writers; started++)
+    {
+        workers[started].index = started < readers ? started : started - readers;
+        if (pthread_create(&workers[started].thread, NULL, started < readers ? picy_reader : picy_writer,
+                           &workers[started]) != 0)
+        {
+            fprintf(stderr, "starting thread %u failed\n", started);
+            total.failed = 1;
+            break;
+        }
+    }
+
+    if (!total.failed)
+    {
+        sleep(seconds);
+    }
+    picy_running = 0;
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        total.failed |= workers[i].failed;
+        total.records += workers[i].records;
+        total.lost += workers[i].lost;
+        total.sequence_errors += workers[i].sequence_errors;
+        total.writes += workers[i].writes;
+        total.mismatches += workers[i].mismatches;
+    }
+
+    duration = (picy_now_ns() - start) / 1e9;
+
+    printf("readers %u writers %u: %.0f records/s (%.0f per reader), %.0f writes/s, "
+           "%llu lost, %llu sequence errors, %llu register mismatches\n",
+           readers, writers, total.records / duration, readers ? total.records / duration / readers : 0.0,
+           total.writes / duration, (unsigned long long)total.lost, (unsigned long long)total.sequence_errors,
+           (unsigned long long)total.mismatches);
+
+    return total.failed || total.sequence_errors || total.mismatches ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *reader_counts = "1,2,4,8";
+    unsigned int writers = 2, seconds = 5, readers;
+    char *list, *token, *end;
+    int option, status = 0;
+
+    while ((option = getopt(argc, argv, "d:r:w:t:")) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            picy_device = optarg;
+            break;
+        case 'r':
+            reader_counts = optarg;
+            break;
+        case 'w':
+            writers = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d device] [-r readers[,readers...]] [-w writers] [-t seconds]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    list = strdup(reader_counts);
+    if (list == NULL)
+    {
+        perror("strdup");
+        return EXIT_FAILURE;
+    }
+
+    for (token = strtok(list, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        readers = strtoul(token, &end, 0);
+        if (*end != '\0' || readers + writers > PICY_MAX_THREADS)
+        {
+            fprintf(stderr, "%s: expected at most %u readers and writers\n", token, PICY_MAX_THREADS);
+            free(list);
+            return EXIT_FAILURE;
+        }
+
+        if (picy_run(readers, writers, seconds) < 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free(list);
+
+    return status;
+}
@@ -0,0 +1,261 @@
+/**
+ * picy user space library for the ds310 sensor driver
+ */
+
+#include <string.h>
+
+#include "picy.h"
+#include "ds310_altitude.h"
+
+/**
+ * @brief Read a little endian base 128 varint, returns 0 if incomplete
+ */
+static size_t picy_get_varint(const uint8_t *data, size_t length, uint64_t *value)
+{
+    size_t i;
+
+    *value = 0;
+    for (i = 0; i < length && i < 10; i++)
+    {
+        *value |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80))
+        {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Inverse of the zigzag mapping of the encoder
+ */
+static int64_t picy_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * @brief Read three varints, returns 0 if incomplete
+ */
+static size_t picy_get_varints(const uint8_t *data, size_t length, uint64_t values[3])
+{
+    size_t used = 0, step = 0;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        step = picy_get_varint(data + used, length - used, &values[i]);
+        if (step == 0)
+        {
+            return 0;
+        }
+        used += step;
+    }
+
+    return used;
+}
+
+void picy_decoder_init(struct picy_decoder *decoder)
+{
+    decoder->last = (struct ds310_sample){0};
+    decoder->last_delta = 0;
+    decoder->synchronized = 0;
+}
+
+size_t picy_find_key_frame(const uint8_t *data, size_t length)
+{
+    size_t offset;
+
+    for (offset = 0; offset + 3 <= length; offset++)
+    {
+        if (data[offset] == DS310_KEY_FRAME_TAG &&
+            data[offset + 1] == DS310_KEY_FRAME_MAGIC0 &&
+            data[offset + 2] == DS310_KEY_FRAME_MAGIC1)
+        {
+            return offset;
+        }
+    }
+
+    /* A tag split across two reads is kept for the next call */
+    for (; offset < length; offset++)
+    {
+        if (data[offset] == DS310_KEY_FRAME_TAG &&
+            (offset + 1 == length || data[offset + 1] == DS310_KEY_FRAME_MAGIC0))
+        {
+            return offset;
+        }
+    }
+
+    return length;
+}
+
+size_t picy_decode(struct picy_decoder *decoder, const uint8_t *data, size_t length,
+                   struct ds310_sample *samples, size_t count, size_t *consumed)
+{
+    struct ds310_config_marker marker;
+    size_t offset = 0, used = 0, decoded = 0;
+    uint64_t values[3];
+    int64_t delta;
+
+    while (decoded < count && offset < length)
+    {
+        if (data[offset] == DS310_CONFIG_FRAME_TAG)
+        {
+            /* Config frame, self contained and followed by a key frame */
+            if (length - offset < 7)
+            {
+                break;
+            }
+            if (data[offset + 1] != DS310_CONFIG_FRAME_MAGIC0 ||
+                data[offset + 2] != DS310_CONFIG_FRAME_MAGIC1)
+            {
+                decoder->synchronized = 0;
+                offset++;
+                continue;
+            }
+
+            used = picy_get_varints(data + offset + 7, length - offset - 7, values);
+            if (used == 0)
+            {
+                break;
+            }
+
+            marker = (struct ds310_config_marker){0};
+            marker.prs_cfg = data[offset + 3];
+            marker.tmp_cfg = data[offset + 4];
+            marker.meas_cfg = data[offset + 5];
+            marker.cfg_reg = data[offset + 6];
+            marker.timestamp = values[0];
+            marker.kp = (int32_t)picy_unzigzag(values[1]);
+            marker.kt = (int32_t)picy_unzigzag(values[2]);
+            marker.flags = DS310_SAMPLE_CONFIG;
+            memcpy(&samples[decoded++], &marker, sizeof(marker));
+
+            offset += 7 + used;
+            decoder->synchronized = 0;
+            continue;
+        }
+
+        if (!decoder->synchronized && data[offset] != DS310_KEY_FRAME_TAG)
+        {
+            offset += picy_find_key_frame(data + offset, length - offset);
+            continue;
+        }
+
+        if (data[offset] & 1)
+        {
+            /* Key frame */
+            if (length - offset < 3)
+            {
+                break;
+            }
+            if (data[offset] != DS310_KEY_FRAME_TAG ||
+                data[offset + 1] != DS310_KEY_FRAME_MAGIC0 ||
+                data[offset + 2] != DS310_KEY_FRAME_MAGIC1)
+            {
+                /* Corrupted stream, resynchronize */
+                decoder->synchronized = 0;
+                offset++;
+                continue;
+            }
+
+            used = picy_get_varints(data + offset + 3, length - offset - 3, values);
+            if (used == 0)
+            {
+                break;
+            }
+            offset += 3 + used;
+
+            decoder->last.timestamp = values[0];
+            decoder->last.pressure_raw = (int32_t)picy_unzigzag(values[1]);
+            decoder->last.temperature_raw = (int32_t)picy_unzigzag(values[2]);
+            decoder->last_delta = 0;
+            decoder->synchronized = 1;
+        }
+        else
+        {
+            /* Delta frame */
+            used = picy_get_varints(data + offset, length - offset, values);
+            if (used == 0)
+            {
+                break;
+            }
+            offset += used;
+
+            delta = decoder->last_delta + picy_unzigzag(values[0] >> 1);
+            decoder->last.timestamp += delta;
+            decoder->last.pressure_raw += (int32_t)picy_unzigzag(values[1]);
+            decoder->last.temperature_raw += (int32_t)picy_unzigzag(values[2]);
+            decoder->last_delta = delta;
+        }
+
+        samples[decoded++] = decoder->last;
+    }
+
+    *consumed = offset;
+
+    return decoded;
+}
+
+int picy_config_marker(const struct ds310_sample *record, struct ds310_config_marker *marker)
+{
+    if (!(record->flags & DS310_SAMPLE_CONFIG))
+    {
+        return 0;
+    }
+
+    memcpy(marker, record, sizeof(*marker));
+
+    return 1;
+}
+
+void picy_compensate(const struct ds310_calibration *c, struct ds310_sample *sample)
+{
+    double ps = (double)sample->pressure_raw / c->kp;
+    double ts = (double)sample->temperature_raw / c->kt;
+    double pressure, temperature;
+
+    temperature = c->c0 * 0.5 + c->c1 * ts;
+    pressure = c->c00 + ps * (c->c10 + ps * (c->c20 + ps * c->c30)) +
+               ts * (c->c01 + ps * (c->c11 + ps * c->c21));
+
+    sample->pressure = (int32_t)(pressure * 1000.0);
+    sample->temperature = (int32_t)(temperature * 1000.0);
+}
+
+int32_t picy_altitude(int32_t pressure, uint32_t sea_level_pressure)
+{
+    const int64_t steps = (int64_t)(sizeof(ds310_altitude_table) / sizeof(ds310_altitude_table[0])) - 1;
+    int64_t ratio, step, fraction;
+    int32_t low, high;
+
+    if (pressure <= 0)
+    {
+        pressure = 0;
+    }
+
+    if (sea_level_pressure == 0)
+    {
+        sea_level_pressure = DS310_SEA_LEVEL_PRESSURE;
+    }
+
+    /* Pressure ratio in Q24, clamped to the table range, as in the driver */
+    ratio = (int64_t)(((uint64_t)pressure << DS310_ALTITUDE_RATIO_SHIFT) / ((uint64_t)sea_level_pressure * 1000));
+    ratio -= DS310_ALTITUDE_RATIO_MIN;
+    if (ratio < 0)
+    {
+        ratio = 0;
+    }
+    if (ratio > steps << DS310_ALTITUDE_STEP_SHIFT)
+    {
+        ratio = steps << DS310_ALTITUDE_STEP_SHIFT;
+    }
+
+    step = ratio >> DS310_ALTITUDE_STEP_SHIFT;
+    fraction = ratio & ((1 << DS310_ALTITUDE_STEP_SHIFT) - 1);
+    low = ds310_altitude_table[step];
+    high = step < steps ? ds310_altitude_table[step + 1] : low;
+
+    return low + (int32_t)((int64_t)(high - low) * fraction / (1 << DS310_ALTITUDE_STEP_SHIFT));
+}
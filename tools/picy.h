@@ -0,0 +1,108 @@
+/**
+ * picy user space library for the ds310 sensor driver
+ *
+ * Decodes the compressed sample stream of the device file and
+ * compensates raw results with the calibration of the sensor.
+ */
+
+#ifndef PICY_H
+#define PICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ds310.h"
+
+/**
+ * Segment files of the picy-recorder
+ *
+ * A segment is a preallocated file with a one page header followed by
+ * page aligned columns: capacity timestamps (uint64_t, nanoseconds),
+ * capacity pressures (int32_t, millipascal), capacity temperatures
+ * (int32_t, millidegree Celsius) and an index holding the timestamp of
+ * every index_stride-th sample. Only the first count entries of each
+ * column are valid. The recorder flushes the columns before it updates
+ * count, so count never covers unwritten data after a crash.
+ */
+#define PICY_SEGMENT_MAGIC "PICYSEG1"
+#define PICY_SEGMENT_VERSION 1
+#define PICY_SEGMENT_OPEN 1
+#define PICY_SEGMENT_CLOSED 2
+#define PICY_SEGMENT_HEADER_SIZE 4096
+
+/**
+ * @brief Header at the start of a segment file
+ */
+struct picy_segment_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t state;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t timestamp_offset;
+    uint64_t pressure_offset;
+    uint64_t temperature_offset;
+    uint64_t index_offset;
+    uint64_t index_stride;
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+};
+
+/**
+ * @brief State of a compressed stream decoder
+ */
+struct picy_decoder
+{
+    struct ds310_sample last;
+    int64_t last_delta;
+    int synchronized;
+};
+
+/**
+ * @brief Reset a decoder, it resynchronizes on the next key frame
+ */
+void picy_decoder_init(struct picy_decoder *decoder);
+
+/**
+ * @brief Decode complete frames into at most count samples
+ *
+ * Data before the first key frame is skipped. Config frames are returned
+ * as configuration markers, records with DS310_SAMPLE_CONFIG set.
+ * Returns the number of decoded records and stores the number of used
+ * bytes in consumed, an incomplete trailing frame is left for the next
+ * call.
+ */
+size_t picy_decode(struct picy_decoder *decoder, const uint8_t *data, size_t length,
+                   struct ds310_sample *samples, size_t count, size_t *consumed);
+
+/**
+ * @brief Return the offset of the next key frame, of a key frame tag cut
+ *        off at the end of data, or length if none
+ */
+size_t picy_find_key_frame(const uint8_t *data, size_t length);
+
+/**
+ * @brief Copy the configuration marker out of a record
+ *
+ * Returns 1 and fills marker if the record is a configuration marker,
+ * 0 if it is a sample.
+ */
+int picy_config_marker(const struct ds310_sample *record, struct ds310_config_marker *marker);
+
+/**
+ * @brief Compensate the raw results of a sample
+ */
+void picy_compensate(const struct ds310_calibration *calibration, struct ds310_sample *sample);
+
+/**
+ * @brief Convert a compensated pressure in millipascal to the altitude in
+ *        millimetres above the sea level pressure in pascal, 0 for the
+ *        standard 101325 Pa
+ *
+ * Uses the lookup table of the driver and returns the same value as the
+ * altitude attribute with the same sea_level_pressure.
+ */
+int32_t picy_altitude(int32_t pressure, uint32_t sea_level_pressure);
+
+#endif /* PICY_H */
@@ -0,0 +1,580 @@
+/**
+ * Header-only C++20 client of the ds310 sensor driver
+ *
+ * picy::stream maps the sample ring of a device file read only and hands
+ * out the unread samples as a picy::batch, a range of ds310_sample
+ * records that refers to the mapping, so consuming samples neither
+ * copies nor allocates. picy::event_loop resumes coroutines that
+ * co_await new samples from an epoll instance. Records with
+ * DS310_SAMPLE_CONFIG in flags are configuration markers
+ * (struct ds310_config_marker) and precede the samples measured with the
+ * new configuration:
+ *
+ *     picy::task consume(picy::stream &stream, picy::event_loop &loop)
+ *     {
+ *         while (true)
+ *         {
+ *             picy::batch samples = co_await stream.wait(loop);
+ *             for (const ds310_sample &sample : samples)
+ *             {
+ *                 ...
+ *             }
+ *             stream.consume(samples);
+ *         }
+ *     }
+ *
+ * Errors are reported as std::system_error.
+ */
+
+#ifndef PICY_HPP
+#define PICY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ds310.h"
+
+namespace picy
+{
+
+/**
+ * @brief Throw errno as std::system_error
+ */
+[[noreturn]] inline void throw_errno(const std::string &what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+/**
+ * @brief Owned file descriptor
+ */
+class file_descriptor
+{
+public:
+    file_descriptor() noexcept = default;
+
+    explicit file_descriptor(int fd) noexcept : fd_(fd)
+    {
+    }
+
+    file_descriptor(file_descriptor &&other) noexcept : fd_(std::exchange(other.fd_, -1))
+    {
+    }
+
+    file_descriptor &operator=(file_descriptor &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    ~file_descriptor()
+    {
+        reset();
+    }
+
+    int get() const noexcept
+    {
+        return fd_;
+    }
+
+    void reset() noexcept
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+private:
+    int fd_ = -1;
+};
+
+/**
+ * @brief Owned read only shared mapping of a file
+ */
+class mapping
+{
+public:
+    mapping() noexcept = default;
+
+    mapping(int fd, std::size_t length) : length_(length)
+    {
+        address_ = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (address_ == MAP_FAILED)
+        {
+            address_ = nullptr;
+            throw_errno("mmap");
+        }
+    }
+
+    mapping(mapping &&other) noexcept
+        : address_(std::exchange(other.address_, nullptr)), length_(std::exchange(other.length_, 0))
+    {
+    }
+
+    mapping &operator=(mapping &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            address_ = std::exchange(other.address_, nullptr);
+            length_ = std::exchange(other.length_, 0);
+        }
+        return *this;
+    }
+
+    ~mapping()
+    {
+        reset();
+    }
+
+    const std::byte *data() const noexcept
+    {
+        return static_cast<const std::byte *>(address_);
+    }
+
+    std::size_t size() const noexcept
+    {
+        return length_;
+    }
+
+    void reset() noexcept
+    {
+        if (address_ != nullptr)
+        {
+            ::munmap(address_, length_);
+            address_ = nullptr;
+            length_ = 0;
+        }
+    }
+
+private:
+    void *address_ = nullptr;
+    std::size_t length_ = 0;
+};
+
+/**
+ * @brief Consecutive samples of the ring, at most two contiguous parts
+ *        because the ring wraps around
+ *
+ * A batch refers to the mapping and stays valid until the driver
+ * overwrites its samples, which picy::stream::consume() reports.
+ */
+class batch
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = ds310_sample;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const ds310_sample *;
+        using reference = const ds310_sample &;
+
+        iterator() noexcept = default;
+
+        iterator(const batch *owner, std::size_t index) noexcept : owner_(owner), index_(index)
+        {
+        }
+
+        reference operator*() const noexcept
+        {
+            return index_ < owner_->first_.size() ? owner_->first_[index_]
+                                                  : owner_->second_[index_ - owner_->first_.size()];
+        }
+
+        pointer operator->() const noexcept
+        {
+            return &**this;
+        }
+
+        iterator &operator++() noexcept
+        {
+            index_++;
+            return *this;
+        }
+
+        iterator operator++(int) noexcept
+        {
+            iterator previous = *this;
+            index_++;
+            return previous;
+        }
+
+        bool operator==(const iterator &other) const noexcept
+        {
+            return index_ == other.index_;
+        }
+
+    private:
+        const batch *owner_ = nullptr;
+        std::size_t index_ = 0;
+    };
+
+    batch() noexcept = default;
+
+    batch(std::span<const ds310_sample> first, std::span<const ds310_sample> second,
+          std::uint64_t sequence, std::uint64_t lost) noexcept
+        : first_(first), second_(second), sequence_(sequence), lost_(lost)
+    {
+    }
+
+    iterator begin() const noexcept
+    {
+        return iterator(this, 0);
+    }
+
+    iterator end() const noexcept
+    {
+        return iterator(this, size());
+    }
+
+    std::size_t size() const noexcept
+    {
+        return first_.size() + second_.size();
+    }
+
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    /** Contiguous parts in order, second is empty unless the batch wraps */
+    std::span<const ds310_sample> first() const noexcept
+    {
+        return first_;
+    }
+
+    std::span<const ds310_sample> second() const noexcept
+    {
+        return second_;
+    }
+
+    /** Number of the first sample since the sensor was probed */
+    std::uint64_t sequence() const noexcept
+    {
+        return sequence_;
+    }
+
+    /** Samples overwritten before this batch was taken */
+    std::uint64_t lost() const noexcept
+    {
+        return lost_;
+    }
+
+private:
+    std::span<const ds310_sample> first_;
+    std::span<const ds310_sample> second_;
+    std::uint64_t sequence_ = 0;
+    std::uint64_t lost_ = 0;
+};
+
+/**
+ * @brief Epoll instance that resumes coroutines waiting for samples
+ */
+class event_loop
+{
+public:
+    event_loop() : epoll_(::epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (epoll_.get() < 0)
+        {
+            throw_errno("epoll_create1");
+        }
+    }
+
+    /** Resume handle once fd is readable */
+    void watch(int fd, std::coroutine_handle<> handle)
+    {
+        epoll_event event = {};
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = handle.address();
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_MOD, fd, &event) < 0)
+        {
+            if (errno != ENOENT || ::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, fd, &event) < 0)
+            {
+                throw_errno("epoll_ctl");
+            }
+        }
+    }
+
+    /** Wait up to timeout_ms and resume the ready coroutines */
+    int run_once(int timeout_ms = -1)
+    {
+        epoll_event events[16];
+        int count = ::epoll_wait(epoll_.get(), events, 16, timeout_ms);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                return 0;
+            }
+            throw_errno("epoll_wait");
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+        }
+
+        return count;
+    }
+
+    /** The epoll descriptor, it can be nested into another event loop */
+    int fd() const noexcept
+    {
+        return epoll_.get();
+    }
+
+private:
+    file_descriptor epoll_;
+};
+
+/**
+ * @brief Coroutine without result that starts immediately, for
+ *        consumers driven by an event_loop
+ */
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * @brief Sample stream of a device file read through the mapped ring
+ */
+class stream
+{
+public:
+    class awaiter
+    {
+    public:
+        awaiter(stream &owner, event_loop &loop) noexcept : owner_(owner), loop_(loop)
+        {
+        }
+
+        bool await_ready() const noexcept
+        {
+            return owner_.head() != owner_.tail_;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            loop_.watch(owner_.fd(), handle);
+        }
+
+        batch await_resume() noexcept
+        {
+            return owner_.next();
+        }
+
+    private:
+        stream &owner_;
+        event_loop &loop_;
+    };
+
+    explicit stream(const std::string &path = "/dev/ds310_sensor")
+        : fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK))
+    {
+        std::uint32_t format = DS310_FORMAT_RECORD;
+        std::size_t length = 0;
+        off_t position = 0;
+
+        if (fd_.get() < 0)
+        {
+            throw_errno(path);
+        }
+
+        /* A streaming format starts the acquisition and makes poll() report samples */
+        if (::ioctl(fd_.get(), DS310_IOC_SET_FORMAT, &format) < 0)
+        {
+            throw_errno("DS310_IOC_SET_FORMAT");
+        }
+
+        /* The header page holds the length of the whole mapping */
+        {
+            mapping header(fd_.get(), ::sysconf(_SC_PAGESIZE));
+            length = reinterpret_cast<const ds310_ring_header *>(header.data())->length;
+        }
+
+        ring_ = mapping(fd_.get(), length);
+        header_ = reinterpret_cast<const ds310_ring_header *>(ring_.data());
+        samples_ = std::span<const ds310_sample>(
+            reinterpret_cast<const ds310_sample *>(ring_.data() + header_->data_offset), header_->size);
+
+        /* The header only holds the low bits of head, the descriptor knows the sample number */
+        position = ::lseek(fd_.get(), 0, SEEK_CUR);
+        if (position < 0)
+        {
+            throw_errno("lseek");
+        }
+        tail_ = static_cast<std::uint64_t>(position);
+    }
+
+    int fd() const noexcept
+    {
+        return fd_.get();
+    }
+
+    /** The whole ring, sample n is at n % samples().size() */
+    std::span<const ds310_sample> samples() const noexcept
+    {
+        return samples_;
+    }
+
+    /**
+     * Number of samples written since the sensor was probed, extended
+     * from the 32-bit head of the ring header relative to the tail
+     */
+    std::uint64_t head() const noexcept
+    {
+        std::uint32_t low = __atomic_load_n(&header_->head, __ATOMIC_ACQUIRE);
+
+        return tail_ + static_cast<std::uint32_t>(low - static_cast<std::uint32_t>(tail_));
+    }
+
+    /**
+     * Unread samples, skipping samples that were already overwritten. The
+     * slot of sample head - size may be overwritten by sample head at any
+     * time, the oldest sample returned is head - size + 1.
+     */
+    batch next() noexcept
+    {
+        std::uint64_t head_now = head(), lost = 0;
+        std::size_t begin, count, first;
+
+        if (head_now - tail_ >= samples_.size())
+        {
+            lost = head_now - samples_.size() + 1 - tail_;
+            tail_ = head_now - samples_.size() + 1;
+        }
+
+        begin = tail_ % samples_.size();
+        count = head_now - tail_;
+        first = std::min(count, samples_.size() - begin);
+
+        return batch(samples_.subspan(begin, first), samples_.subspan(0, count - first), tail_, lost);
+    }
+
+    /**
+     * Mark a batch as read, returns how many of its samples were
+     * overwritten while it was in use and must be discarded
+     */
+    std::uint64_t consume(const batch &samples)
+    {
+        std::uint64_t head_now, overwritten = 0;
+
+        /* The samples were read before head is loaded again */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        head_now = head();
+
+        if (head_now - samples.sequence() >= samples_.size())
+        {
+            overwritten = std::min<std::uint64_t>(head_now - samples_.size() + 1 - samples.sequence(), samples.size());
+        }
+
+        tail_ = samples.sequence() + samples.size();
+        acknowledge();
+
+        return overwritten;
+    }
+
+    /** Awaitable that completes with the next non-empty batch */
+    awaiter wait(event_loop &loop) noexcept
+    {
+        return awaiter(*this, loop);
+    }
+
+    /** Cached statistics, see struct ds310_stats */
+    ds310_stats stats() const
+    {
+        ds310_stats result = {};
+
+        if (::ioctl(fd_.get(), DS310_IOC_GET_STATS, &result) < 0)
+        {
+            throw_errno("DS310_IOC_GET_STATS");
+        }
+
+        return result;
+    }
+
+    ds310_calibration calibration() const
+    {
+        ds310_calibration result = {};
+
+        if (::ioctl(fd_.get(), DS310_IOC_GET_CALIBRATION, &result) < 0)
+        {
+            throw_errno("DS310_IOC_GET_CALIBRATION");
+        }
+
+        return result;
+    }
+
+private:
+    /** Tell the driver the read position so poll() waits for newer samples */
+    void acknowledge()
+    {
+        if (::lseek(fd_.get(), static_cast<off_t>(tail_), SEEK_SET) < 0)
+        {
+            throw_errno("lseek");
+        }
+    }
+
+    file_descriptor fd_;
+    mapping ring_;
+    const ds310_ring_header *header_ = nullptr;
+    std::span<const ds310_sample> samples_;
+    std::uint64_t tail_ = 0;
+};
+
+} // namespace picy
+
+#endif /* PICY_HPP */
@@ -0,0 +1,505 @@
+/**
+ * picyctl configures the ds310 sensor and streams its samples
+ *
+ * Usage: picyctl [-d device] config [name=value ...]
+ *        picyctl [-d device] dump
+ *        picyctl [-d device] stream [-f csv|binary|compressed] [-n count] [--stats]
+ *
+ * Configuration names:
+ *   pressure-rate, temperature-rate                1 to 128 measurements/s
+ *   pressure-oversampling, temperature-oversampling 1 to 128 times
+ *   mode                                           idle, pressure, temperature,
+ *                                                  continuous-pressure,
+ *                                                  continuous-temperature or
+ *                                                  continuous
+ *
+ * The stream command reads batches of records, or the compressed stream
+ * for -f compressed, and stops after count records. With --stats it
+ * prints the achieved sample rate, configuration markers not counted,
+ * and the dropped samples to stderr once per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "picy.h"
+
+#define PICY_PRS_CFG 0x06
+#define PICY_TMP_CFG 0x07
+#define PICY_MEAS_CFG 0x08
+#define PICY_CFG_REG 0x09
+#define PICY_RATE_SHIFT 4
+#define PICY_RATE_MASK 0x70
+#define PICY_OVERSAMPLING_MASK 0x0F
+#define PICY_MEAS_CTRL_MASK 0x07
+#define PICY_P_SHIFT 0x04
+#define PICY_T_SHIFT 0x08
+#define PICY_BATCH 1024
+#define PICY_BUFFER_SIZE (PICY_BATCH * sizeof(struct ds310_sample))
+
+/**
+ * Measurement modes by name, indexed by the MEAS_CTRL field
+ */
+static const char *const picy_modes[] =
+{
+    "idle", "pressure", "temperature", NULL, NULL, "continuous-pressure", "continuous-temperature", "continuous",
+};
+
+/**
+ * Register names of the dump
+ */
+static const char *const picy_register_names[DS310_REGISTER_COUNT] =
+{
+    [0x00] = "PSR_B2", [0x01] = "PSR_B1", [0x02] = "PSR_B0",
+    [0x03] = "TMP_B2", [0x04] = "TMP_B1", [0x05] = "TMP_B0",
+    [0x06] = "PRS_CFG", [0x07] = "TMP_CFG", [0x08] = "MEAS_CFG", [0x09] = "CFG_REG",
+    [0x0A] = "INT_STS", [0x0B] = "FIFO_STS", [0x0C] = "RESET", [0x0D] = "PRODUCT_ID",
+    [0x28] = "COEF_SRCE",
+};
+
+static volatile sig_atomic_t picy_running = 1;
+
+/**
+ * @brief Stop streaming on SIGINT or SIGTERM
+ */
+static void picy_stop(int signal_number)
+{
+    (void)signal_number;
+    picy_running = 0;
+}
+
+/**
+ * @brief Return CLOCK_MONOTONIC in nanoseconds
+ */
+static uint64_t picy_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @brief Return the field value of a power of two from 1 to 128
+ */
+static int picy_log2_field(const char *value)
+{
+    char *end = NULL;
+    unsigned long number = strtoul(value, &end, 10);
+    int field;
+
+    if (*value == '\0' || *end != '\0')
+    {
+        return -1;
+    }
+
+    for (field = 0; field < 8; field++)
+    {
+        if (number == 1UL << field)
+        {
+            return field;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Write a register with the two byte write protocol
+ */
+static int picy_write_register(int fd, uint8_t address, uint8_t value)
+{
+    uint8_t buffer[2] = { address, value };
+
+    return write(fd, buffer, 2) == 2 ? 0 : -1;
+}
+
+/**
+ * @brief Apply name=value settings with one read-modify-write per register
+ */
+static int picy_config(int fd, int argc, char **argv)
+{
+    struct ds310_registers registers;
+    int prs_cfg, tmp_cfg, meas_cfg, cfg_reg, field, i;
+    char *name, *value;
+
+    /* One snapshot, the register protocol may be built out of the driver */
+    if (ioctl(fd, DS310_IOC_GET_REGISTERS, &registers) < 0)
+    {
+        perror("DS310_IOC_GET_REGISTERS");
+        return -1;
+    }
+
+    prs_cfg = registers.values[PICY_PRS_CFG];
+    tmp_cfg = registers.values[PICY_TMP_CFG];
+    meas_cfg = registers.values[PICY_MEAS_CFG];
+    cfg_reg = registers.values[PICY_CFG_REG];
+
+    for (i = 0; i < argc; i++)
+    {
+        name = argv[i];
+        value = strchr(name, '=');
+        if (value == NULL)
+        {
+            fprintf(stderr, "%s: expected name=value\n", name);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(name, "mode") == 0)
+        {
+            for (field = 0; field < 8; field++)
+            {
+                if (picy_modes[field] != NULL && strcmp(value, picy_modes[field]) == 0)
+                {
+                    break;
+                }
+            }
+            if (field == 8)
+            {
+                fprintf(stderr, "mode: unknown mode %s\n", value);
+                return -1;
+            }
+            meas_cfg = (meas_cfg & ~PICY_MEAS_CTRL_MASK) | field;
+            continue;
+        }
+
+        field = picy_log2_field(value);
+        if (field < 0)
+        {
+            fprintf(stderr, "%s: %s is not a power of two from 1 to 128\n", name, value);
+            return -1;
+        }
+
+        if (strcmp(name, "pressure-rate") == 0)
+        {
+            prs_cfg = (prs_cfg & ~PICY_RATE_MASK) | (field << PICY_RATE_SHIFT);
+        }
+        else if (strcmp(name, "temperature-rate") == 0)
+        {
+            tmp_cfg = (tmp_cfg & ~PICY_RATE_MASK) | (field << PICY_RATE_SHIFT);
+        }
+        else if (strcmp(name, "pressure-oversampling") == 0)
+        {
+            prs_cfg = (prs_cfg & ~PICY_OVERSAMPLING_MASK) | field;
+        }
+        else if (strcmp(name, "temperature-oversampling") == 0)
+        {
+            tmp_cfg = (tmp_cfg & ~PICY_OVERSAMPLING_MASK) | field;
+        }
+        else
+        {
+            fprintf(stderr, "%s: unknown setting\n", name);
+            return -1;
+        }
+    }
+
+    /* Results of more than 8 times oversampling need the shift bits */
+    cfg_reg &= ~(PICY_P_SHIFT | PICY_T_SHIFT);
+    cfg_reg |= (prs_cfg & PICY_OVERSAMPLING_MASK) > 3 ? PICY_P_SHIFT : 0;
+    cfg_reg |= (tmp_cfg & PICY_OVERSAMPLING_MASK) > 3 ? PICY_T_SHIFT : 0;
+
+    /* Stop measuring while the configuration changes */
+    if (picy_write_register(fd, PICY_MEAS_CFG, meas_cfg & ~PICY_MEAS_CTRL_MASK) < 0 ||
+        picy_write_register(fd, PICY_PRS_CFG, prs_cfg) < 0 ||
+        picy_write_register(fd, PICY_TMP_CFG, tmp_cfg) < 0 ||
+        picy_write_register(fd, PICY_CFG_REG, cfg_reg) < 0 ||
+        picy_write_register(fd, PICY_MEAS_CFG, meas_cfg) < 0)
+    {
+        perror("writing configuration");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print all registers fetched with one ioctl
+ */
+static int picy_dump(int fd)
+{
+    struct ds310_registers registers;
+    int i;
+
+    if (ioctl(fd, DS310_IOC_GET_REGISTERS, &registers) < 0)
+    {
+        perror("DS310_IOC_GET_REGISTERS");
+        return -1;
+    }
+
+    for (i = 0; i < DS310_REGISTER_COUNT; i++)
+    {
+        if (picy_register_names[i] != NULL)
+        {
+            printf("0x%02x %-10s 0x%02x\n", i, picy_register_names[i], registers.values[i]);
+        }
+        else if (i >= 0x10 && i < 0x22)
+        {
+            printf("0x%02x COEF+%-5d 0x%02x\n", i, i - 0x10, registers.values[i]);
+        }
+        else
+        {
+            printf("0x%02x %-10s 0x%02x\n", i, "reserved", registers.values[i]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Count the samples among records, configuration markers are not
+ *        samples
+ */
+static uint64_t picy_count_samples(const struct ds310_sample *records, size_t count)
+{
+    uint64_t samples = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!(records[i].flags & DS310_SAMPLE_CONFIG))
+        {
+            samples++;
+        }
+    }
+
+    return samples;
+}
+
+/**
+ * @brief Print the achieved rate and the dropped samples
+ */
+static void picy_print_stats(int fd, uint64_t samples, uint64_t start, uint64_t now)
+{
+    struct ds310_stats stats = {0};
+    double seconds = (now - start) / 1e9;
+
+    ioctl(fd, DS310_IOC_GET_STATS, &stats);
+    fprintf(stderr, "%llu samples in %.1f s, %.1f samples/s, %llu dropped\n",
+            (unsigned long long)samples, seconds, seconds > 0 ? samples / seconds : 0.0,
+            (unsigned long long)stats.dropped);
+}
+
+/**
+ * @brief Stream samples to stdout
+ */
+static int picy_stream(int fd, const char *format, uint64_t count, int print_stats)
+{
+    static uint8_t buffer[PICY_BUFFER_SIZE];
+    struct ds310_sample samples[PICY_BATCH];
+    const struct ds310_sample *sample;
+    struct picy_decoder decoder;
+    struct sigaction action = {0};
+    uint64_t received = 0, samples_received = 0, start, last_stats, now;
+    uint32_t stream_format = DS310_FORMAT_RECORD;
+    size_t decoded, consumed, limit, pending = 0, i;
+    int csv = strcmp(format, "csv") == 0;
+    ssize_t length;
+
+    if (strcmp(format, "compressed") == 0)
+    {
+        stream_format = DS310_FORMAT_COMPRESSED;
+    }
+    else if (!csv && strcmp(format, "binary") != 0)
+    {
+        fprintf(stderr, "%s: unknown format\n", format);
+        return -1;
+    }
+
+    action.sa_handler = picy_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (ioctl(fd, DS310_IOC_SET_FORMAT, &stream_format) < 0)
+    {
+        perror("DS310_IOC_SET_FORMAT");
+        return -1;
+    }
+
+    picy_decoder_init(&decoder);
+    if (csv)
+    {
+        setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+        printf("timestamp_ns,pressure_pa,temperature_c\n");
+    }
+
+    start = last_stats = picy_now_ns();
+
+    while (picy_running && (count == 0 || received < count))
+    {
+        length = read(fd, buffer + pending, sizeof(buffer) - pending);
+        if (length < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+
+        if (stream_format == DS310_FORMAT_COMPRESSED)
+        {
+            /* Frames are passed through up to the last counted record, they are only decoded to count them */
+            pending += length;
+            do
+            {
+                limit = PICY_BATCH;
+                if (count != 0 && limit > count - received)
+                {
+                    limit = count - received;
+                }
+
+                decoded = picy_decode(&decoder, buffer, pending, samples, limit, &consumed);
+                if (fwrite(buffer, 1, consumed, stdout) != consumed)
+                {
+                    return -1;
+                }
+                memmove(buffer, buffer + consumed, pending - consumed);
+                pending -= consumed;
+                received += decoded;
+                samples_received += picy_count_samples(samples, decoded);
+            } while (decoded == PICY_BATCH);
+        }
+        else
+        {
+            decoded = length / sizeof(struct ds310_sample);
+            if (count != 0 && decoded > count - received)
+            {
+                decoded = count - received;
+            }
+
+            sample = (const struct ds310_sample *)buffer;
+            if (csv)
+            {
+                for (i = 0; i < decoded; i++)
+                {
+                    if (sample[i].flags & DS310_SAMPLE_CONFIG)
+                    {
+                        continue;
+                    }
+                    printf("%llu,%.3f,%.3f\n", (unsigned long long)sample[i].timestamp,
+                           sample[i].pressure / 1e3, sample[i].temperature / 1e3);
+                }
+            }
+            else if (fwrite(sample, sizeof(*sample), decoded, stdout) != decoded)
+            {
+                return -1;
+            }
+            received += decoded;
+            samples_received += picy_count_samples(sample, decoded);
+        }
+
+        now = picy_now_ns();
+        if (print_stats && now - last_stats >= 1000000000)
+        {
+            picy_print_stats(fd, samples_received, start, now);
+            last_stats = now;
+        }
+    }
+
+    fflush(stdout);
+    if (print_stats)
+    {
+        picy_print_stats(fd, samples_received, start, picy_now_ns());
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Print the usage
+ */
+static void picy_usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-d device] config [name=value ...]\n"
+            "       %s [-d device] dump\n"
+            "       %s [-d device] stream [-f csv|binary|compressed] [-n count] [--stats]\n",
+            program, program, program);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] =
+    {
+        { "device", required_argument, NULL, 'd' },
+        { "format", required_argument, NULL, 'f' },
+        { "count", required_argument, NULL, 'n' },
+        { "stats", no_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+    const char *device = "/dev/ds310_sensor", *format = "csv", *command;
+    uint64_t count = 0;
+    int fd, option, print_stats = 0, status;
+
+    /* Options may precede or follow the command */
+    while ((option = getopt_long(argc, argv, "d:f:n:s", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            device = optarg;
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            print_stats = 1;
+            break;
+        default:
+            picy_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        picy_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    command = argv[optind++];
+
+    fd = open(device, (strcmp(command, "config") == 0 ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(device);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(command, "config") == 0)
+    {
+        status = picy_config(fd, argc - optind, argv + optind);
+    }
+    else if (strcmp(command, "dump") == 0)
+    {
+        status = picy_dump(fd);
+    }
+    else if (strcmp(command, "stream") == 0)
+    {
+        status = picy_stream(fd, format, count, print_stats);
+    }
+    else
+    {
+        picy_usage(argv[0]);
+        status = -1;
+    }
+
+    close(fd);
+
+    return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}